@@ -0,0 +1,32 @@
+//requests-bench, an open loop load generator built on this library
+//Compile with: g++ -std=c++17 -O2 requests-bench.cpp requests.cpp -o requests-bench -lssl -lcrypto -lz -pthread
+//Usage: requests-bench [-R rate] [-d seconds] [-c connections] [-b body] [-p] url
+#include "requests.hpp"
+#include <iostream>
+
+int main(int argc, char **argv) {
+    HTTPLoadConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-R" && hasValue) {
+            config.rate = std::atof(argv[++i]);
+        } else if (arg == "-d" && hasValue) {
+            config.seconds = std::atof(argv[++i]);
+        } else if (arg == "-c" && hasValue) {
+            config.connections = std::atoi(argv[++i]);
+        } else if (arg == "-b" && hasValue) {
+            config.body = argv[++i];
+        } else if (arg == "-p") {
+            config.post = true;
+        } else {
+            config.url = arg;
+        }
+    }
+    if (config.url.empty()) {
+        std::cerr << "usage: requests-bench [-R rate] [-d seconds] [-c connections] [-b body] [-p] url" << std::endl;
+        return 2;
+    }
+    HTTPLoadReport report = benchmark_load(config);
+    return report.requests > 0 && report.errors == 0 ? 0 : 1;
+}
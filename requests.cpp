@@ -13,12 +13,42 @@
 #include <fstream>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 #include <sstream>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cstdint>
+#include <cmath>
+#include <csignal>
+#include <cerrno>
+#ifndef REQUESTS_NO_TLS
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#else
+//Opaque stand-ins so HTTPConnection keeps its fields, they are never allocated
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+#endif
+#ifndef REQUESTS_NO_ZLIB
+#include <zlib.h>
+#endif
+#ifdef REQUESTS_ZSTD
+#include <zstd.h>
+#endif
 #if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #else
@@ -34,11 +64,77 @@
 #endif
 
 typedef std::string string;
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+typedef int SOCKET;
+#define INVALID_SOCKET -1
+#endif
+
+//Writes to a peer that closed must fail with EPIPE instead of raising SIGPIPE, without touching the process wide handler
+//send() takes MSG_NOSIGNAL, Apple sockets get SO_NOSIGPIPE, elsewhere SIGPIPE is blocked around OpenSSL calls
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+#if !defined(SO_NOSIGPIPE) && (defined(__unix__) || defined(__linux__))
+#define REQUESTS_MASK_SIGPIPE
+#endif
+
+//Marks sock so writes to a closed peer never raise SIGPIPE, where the platform has a socket option for it
+static void disableSigpipe(SOCKET sock) {
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+    (void)sock;
+#endif
+}
+
+//Struct blocking SIGPIPE on the calling thread while an OpenSSL call may write to the socket
+//OpenSSL writes with write(), which has no MSG_NOSIGNAL, so a SIGPIPE raised meanwhile is discarded before the mask is restored
+struct SigpipeGuard {
+#ifdef REQUESTS_MASK_SIGPIPE
+    sigset_t old;
+    bool pendingBefore;
+
+    SigpipeGuard() {
+        sigset_t pipe, pending;
+        sigemptyset(&pipe);
+        sigaddset(&pipe, SIGPIPE);
+        sigpending(&pending);
+        //A SIGPIPE that was already pending is not ours to discard
+        pendingBefore = sigismember(&pending, SIGPIPE) == 1;
+        pthread_sigmask(SIG_BLOCK, &pipe, &old);
+    }
+
+    ~SigpipeGuard() {
+        if (!pendingBefore) {
+            sigset_t pipe, pending;
+            sigemptyset(&pipe);
+            sigaddset(&pipe, SIGPIPE);
+            sigpending(&pending);
+            if (sigismember(&pending, SIGPIPE) == 1) {
+                struct timespec zero = { 0, 0 };
+                while (sigtimedwait(&pipe, NULL, &zero) == -1 && errno == EINTR) {
+                }
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+#else
+    SigpipeGuard() {
+    }
+#endif
+};
 
+#ifndef REQUESTS_NO_TLS
 static int always_true_callback(X509_STORE_CTX *ctx, void *arg)
 {
+    (void)ctx;
+    (void)arg;
     return 1;
 }
+#endif
 
 std::vector<std::string> split(std::string str, char delimiter) {
   std::vector<std::string> internal;
@@ -52,7 +148,8 @@ std::vector<std::string> split(std::string str, char delimiter) {
   return internal;
 }
 
-bool is_number(std::string s)
+#if !(defined(__unix__) || defined(__linux__) || defined(__APPLE__))
+static bool is_number(std::string s)
 {
     int dotCount = 0;
     if (s.empty())
@@ -67,12 +164,15 @@ bool is_number(std::string s)
     }
     return true;
 }
+#endif
 
 bool is_ip_address(string ip) {
 #if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
-    struct sockaddr_in sa;
-    int result = inet_pton(AF_INET, ip.c_str(), &(sa.sin_addr));
-    return result != 0;
+    struct in6_addr addr;
+    if (inet_pton(AF_INET, ip.c_str(), &addr) == 1) {
+        return true;
+    }
+    return inet_pton(AF_INET6, ip.c_str(), &addr) == 1;
 #else
     std::vector<string> ip_split = split(ip, '.');
     if (ip_split.size() != 4) {
@@ -108,6 +208,109 @@ string resolvdnsname(string dnsname) {
 #endif
 }
 
+//Resolves dnsname to every address it has, in the order the resolver returns them
+static std::vector<string> resolveAllAddresses(string dnsname) {
+    std::vector<string> addresses;
+#if !(defined(__unix__) || defined(__linux__) || defined(__APPLE__))
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(dnsname.c_str(), NULL, &hints, &result) != 0) {
+        return addresses;
+    }
+    for (struct addrinfo *ptr = result; ptr != NULL; ptr = ptr->ai_next) {
+        char ip[INET6_ADDRSTRLEN];
+        void *addr;
+        if (ptr->ai_family == AF_INET) {
+            addr = &((struct sockaddr_in *)ptr->ai_addr)->sin_addr;
+        } else if (ptr->ai_family == AF_INET6) {
+            addr = &((struct sockaddr_in6 *)ptr->ai_addr)->sin6_addr;
+        } else {
+            continue;
+        }
+        if (inet_ntop(ptr->ai_family, addr, ip, sizeof(ip)) != NULL
+            && std::find(addresses.begin(), addresses.end(), ip) == addresses.end()) {
+            addresses.push_back(ip);
+        }
+    }
+    freeaddrinfo(result);
+    return addresses;
+}
+
+//Resolves every name in dnsnames concurrently on up to maxParallel threads, one lookup each however often a name repeats
+//Returns name -> address, IPv4 addresses are preferred like resolvdnsname and names that fail map to ""
+std::map<string, string> resolvdnsnames(std::vector<string> dnsnames, int maxParallel) {
+    std::map<string, string> resolved;
+    for (const string &name : dnsnames) {
+        resolved[name] = is_ip_address(name) ? name : "";
+    }
+    std::vector<std::map<string, string>::iterator> pending;
+    for (auto it = resolved.begin(); it != resolved.end(); ++it) {
+        if (it->second.empty() && !it->first.empty()) {
+            pending.push_back(it);
+        }
+    }
+    //getaddrinfo blocks, so the lookups overlap by running on their own threads
+    //Each thread writes only the entries it claimed, the map itself is not modified
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < pending.size(); i = next++) {
+            std::vector<string> addresses = resolveAllAddresses(pending[i]->first);
+            for (const string &address : addresses) {
+                if (address.find(':') == string::npos) {
+                    pending[i]->second = address;
+                    break;
+                }
+            }
+            if (pending[i]->second.empty() && !addresses.empty()) {
+                pending[i]->second = addresses[0];
+            }
+        }
+    };
+    size_t threads = std::min(pending.size(), (size_t)std::max(maxParallel, 1));
+    std::vector<std::thread> resolvers;
+    for (size_t i = 1; i < threads; i++) {
+        resolvers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &resolver : resolvers) {
+        resolver.join();
+    }
+    return resolved;
+}
+
+//Fills the empty ipaddr fields of requests from one batch of concurrent lookups
+//Requests over a unix socket and names that do not resolve are left to be resolved at dispatch
+template <typename Request>
+static void resolveRequestBatch(std::vector<Request> &requests, int maxParallel) {
+    std::vector<string> names;
+    for (const Request &request : requests) {
+        if (request.ipaddr.empty() && request.socketPath.empty() && !request.host.empty()) {
+            names.push_back(request.host);
+        }
+    }
+    std::map<string, string> resolved = resolvdnsnames(names, maxParallel);
+    for (Request &request : requests) {
+        if (request.ipaddr.empty() && request.socketPath.empty() && !request.host.empty()) {
+            request.ipaddr = resolved[request.host];
+        }
+    }
+}
+
+//Will resolve the hosts of many GET requests at once and store the addresses in their ipaddr fields
+void resolveRequestHosts(std::vector<HTTPGetRequest> &requests, int maxParallel) {
+    resolveRequestBatch(requests, maxParallel);
+}
+
+//Will resolve the hosts of many POST requests at once and store the addresses in their ipaddr fields
+void resolveRequestHosts(std::vector<HTTPPostRequest> &requests, int maxParallel) {
+    resolveRequestBatch(requests, maxParallel);
+}
+
 void downloadFile(HTTPResponse response, string outfile) {
 #if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
     if (std::filesystem::exists(outfile)) {
@@ -124,7 +327,8 @@ void downloadFile(HTTPResponse response, string outfile) {
     return;
 }
 
-SSL_CTX *initSSL(bool verify) {
+#ifndef REQUESTS_NO_TLS
+static SSL_CTX *initSSL(bool verify) {
     SSL_library_init();
     SSL_CTX *ctx;
 #if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
@@ -140,223 +344,553 @@ SSL_CTX *initSSL(bool verify) {
     }
     return ctx;
 }
+#endif
 
 #if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
-void CloseSocket(int socket) {
+static void CloseSocket(SOCKET socket) {
     close(socket);
 }
 #else
-void CloseSocket(SOCKET socket) {
+static void CloseSocket(SOCKET socket) {
     closesocket(socket);
 }
 #endif
 
-string send_ssl_payload(string host, int port, string packet, bool verify) {
+#ifndef REQUESTS_NO_TLS
+//Asks OpenSSL to hand the record layer to the kernel after the handshake
+//OpenSSL falls back to userspace when the tls module is missing or the cipher is not supported
+static void enableKTLS(SSL *ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(REQUESTS_NO_KTLS)
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+//Returns true if kTLS took over sending or receiving on ssl
+static bool isKTLSActive(SSL *ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(REQUESTS_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) || BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
+#endif
+
+//Kinds of failure counted by the metrics registry
+enum HTTPErrorKind {
+    ERROR_NONE,
+    ERROR_DNS,
+    ERROR_CONNECT,
+    ERROR_TLS,
+    ERROR_WRITE,
+    ERROR_READ,
+    ERROR_PARSE,
+    ERROR_REJECTED,
+    ERROR_LIMIT,
+    ERROR_KIND_COUNT
+};
+
+static const char *error_kind_names[ERROR_KIND_COUNT] = { "none", "dns", "connect", "tls", "write", "read", "parse", "rejected", "limit" };
+
+//Returns the milliseconds elapsed since start
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Struct defining an open connection, ssl is NULL for plain http
+struct HTTPConnection {
+    SOCKET sock = INVALID_SOCKET;
+    SSL_CTX *ctx = NULL;
+    SSL *ssl = NULL;
+    //Set when the kernel encrypts or decrypts the TLS records (kTLS)
+    bool ktls = false;
+    //Per request accounting read by the metrics registry
+    HTTPErrorKind error = ERROR_NONE;
+    bool dnsLookup = false;
+    bool opened = false;
+    bool tlsHandshake = false;
+    double dnsMs = 0;
+    double connectMs = 0;
+    double tlsMs = 0;
+    unsigned long long bytesSent = 0;
+    unsigned long long bytesReceived = 0;
+    std::chrono::steady_clock::time_point sendStart;
+    std::chrono::steady_clock::time_point firstByte;
+    //Set when the connection was taken from the pool instead of opened for this request
+    bool reused = false;
+    //Set by receiveResponse when the response left the connection ready for another request
+    bool reusable = false;
+};
+
+//Closes the socket and frees any ssl state held by conn
+static void closeConnection(HTTPConnection &conn) {
+#ifndef REQUESTS_NO_TLS
+    if (conn.ssl != NULL) {
+        SSL_free(conn.ssl);
+        conn.ssl = NULL;
+    }
+    if (conn.ctx != NULL) {
+        SSL_CTX_free(conn.ctx);
+        conn.ctx = NULL;
+    }
+#endif
+    if (conn.sock != INVALID_SOCKET) {
+        CloseSocket(conn.sock);
+        conn.sock = INVALID_SOCKET;
+#if !(defined(__unix__) || defined(__linux__) || defined(__APPLE__))
+        WSACleanup();
+#endif
+    }
+}
+
+//Opens a tcp connection to host:port, dns names are resolved first
+static bool openSocket(HTTPConnection &conn, string host, int port) {
+    //IPv6 literals arrive in their URL form, [::1]
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    auto phaseStart = std::chrono::steady_clock::now();
     if (!is_ip_address(host)) {
         host = resolvdnsname(host);
+        conn.dnsLookup = true;
+        conn.dnsMs = elapsedMs(phaseStart);
+        if (host.empty()) {
+            conn.error = ERROR_DNS;
+            return false;
+        }
     }
-#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
-    string result;
-    int sockfd;
-    int sslsockfd;
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        return "";
+#if !(defined(__unix__) || defined(__linux__) || defined(__APPLE__))
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        conn.error = ERROR_CONNECT;
+        return false;
     }
-    struct sockaddr_in sa;
+#endif
+    struct sockaddr_storage sa;
+    socklen_t salen;
     memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    sa.sin_addr.s_addr = inet_addr(host.c_str());
-    socklen_t socklen = sizeof(sa);
-    if (connect(sockfd, (struct sockaddr *)&sa, socklen) < 0) {
-        return "";
-    }
-    SSL_CTX *ctx = initSSL(verify);
-    SSL *ssl = SSL_new(ctx);
-    if (!ssl) {
-        return "";
+    if (host.find(':') != string::npos) {
+        struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)&sa;
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port = htons(port);
+        inet_pton(AF_INET6, host.c_str(), &sa6->sin6_addr);
+        salen = sizeof(struct sockaddr_in6);
+    } else {
+        struct sockaddr_in *sa4 = (struct sockaddr_in *)&sa;
+        sa4->sin_family = AF_INET;
+        sa4->sin_port = htons(port);
+        sa4->sin_addr.s_addr = inet_addr(host.c_str());
+        salen = sizeof(struct sockaddr_in);
     }
-    sslsockfd = SSL_get_fd(ssl);
-    SSL_set_fd(ssl, sockfd);
-    if (SSL_connect(ssl) < 0) {
-        return "";
+    conn.sock = socket(sa.ss_family, SOCK_STREAM, 0);
+    if (conn.sock == INVALID_SOCKET) {
+#if !(defined(__unix__) || defined(__linux__) || defined(__APPLE__))
+        WSACleanup();
+#endif
+        conn.error = ERROR_CONNECT;
+        return false;
     }
-    int bytesSent = SSL_write(ssl, packet.c_str(), packet.size());
-    if (bytesSent <= 0) {
-        return "";
+    disableSigpipe(conn.sock);
+    phaseStart = std::chrono::steady_clock::now();
+    if (connect(conn.sock, (struct sockaddr *)&sa, salen) < 0) {
+        closeConnection(conn);
+        conn.error = ERROR_CONNECT;
+        return false;
     }
+    conn.opened = true;
+    conn.connectMs = elapsedMs(phaseStart);
+    return true;
+}
 
-    char buffer[4096];
-    int size = 0;
-    while (true) {
-        int read = SSL_read(ssl, buffer, 4096);
-        size += read;
-        result += string(buffer, read);
-        if (read < 4096) {
-            break;
-        }
+//Connects conn to the AF_UNIX stream socket at path, only available on POSIX systems
+static bool openUnixSocket(HTTPConnection &conn, const string &path) {
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+        conn.error = ERROR_CONNECT;
+        return false;
     }
-
-    SSL_free(ssl);
-    SSL_CTX_free(ctx);
-    CloseSocket(sockfd);
-    return result;
+    memcpy(sa.sun_path, path.data(), path.size());
+    conn.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn.sock == INVALID_SOCKET) {
+        conn.error = ERROR_CONNECT;
+        return false;
+    }
+    disableSigpipe(conn.sock);
+    auto phaseStart = std::chrono::steady_clock::now();
+    if (connect(conn.sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        closeConnection(conn);
+        conn.error = ERROR_CONNECT;
+        return false;
+    }
+    conn.opened = true;
+    conn.connectMs = elapsedMs(phaseStart);
+    return true;
 #else
-    
-    SSL_CTX *ctx = initSSL(verify);
-    SSL *ssl;
-    BIO* bio = BIO_new_ssl_connect(ctx);
-    if (bio == NULL) {
-        return "";
+    conn.error = ERROR_CONNECT;
+    return false;
+#endif
+}
+
+//Completes the ssl handshake on the open socket of conn
+//servername is sent as SNI when it is a dns name
+static bool startTLS(HTTPConnection &conn, bool verify, const string &servername) {
+#ifndef REQUESTS_NO_TLS
+    auto phaseStart = std::chrono::steady_clock::now();
+    conn.ctx = initSSL(verify);
+    conn.ssl = SSL_new(conn.ctx);
+    if (conn.ssl == NULL) {
+        closeConnection(conn);
+        conn.error = ERROR_TLS;
+        return false;
     }
-    BIO_get_ssl(bio, &ssl);
-    SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
-    BIO_set_conn_hostname(bio, (host + ":" + std::to_string(port)).c_str());
-    if (BIO_do_connect(bio) <= 0) {
-        BIO_free_all(bio);
-        SSL_CTX_free(ctx);
-        return "";
+    SSL_set_fd(conn.ssl, (int)conn.sock);
+    enableKTLS(conn.ssl);
+    if (!servername.empty() && servername.front() != '[' && !is_ip_address(servername)) {
+        SSL_set_tlsext_host_name(conn.ssl, servername.c_str());
     }
-    if (BIO_do_handshake(bio) <= 0) {
-        BIO_free_all(bio);
-        SSL_CTX_free(ctx);
-        return "";
+    SigpipeGuard sigpipe;
+    if (SSL_connect(conn.ssl) != 1) {
+        closeConnection(conn);
+        conn.error = ERROR_TLS;
+        return false;
     }
+    conn.tlsHandshake = true;
+    conn.tlsMs = elapsedMs(phaseStart);
+    conn.ktls = isKTLSActive(conn.ssl);
+    return true;
+#else
+    (void)verify;
+    (void)servername;
+    closeConnection(conn);
+    conn.error = ERROR_TLS;
+    return false;
+#endif
+}
 
-    //Send over socket
-    int bytesSent = SSL_write(ssl, packet.c_str(), packet.size());
-    if (bytesSent <= 0) {
-        BIO_free_all(bio);
-        SSL_CTX_free(ctx);
-        return "";
+//Opens a connection to host:port and completes the ssl handshake if isSsl is set
+//servername is sent as SNI when it is a dns name
+static bool openConnection(HTTPConnection &conn, string host, int port, bool isSsl, bool verify, string servername) {
+#ifdef REQUESTS_NO_TLS
+    if (isSsl) {
+        return false;
     }
-    if (bytesSent < packet.size()) {
-        BIO_free_all(bio);
-        SSL_CTX_free(ctx);
-        return "";
+#endif
+    if (!openSocket(conn, host, port)) {
+        return false;
     }
-    char buf[4096];
-    string response = "";
-    int bytesReceived = 0;
-    while (true) {
-        bytesReceived = SSL_read(ssl, buf, 4096);
-        if (bytesReceived < 1) {
-            break;
+    return !isSsl || startTLS(conn, verify, servername);
+}
+
+//Writes all of data to conn, returns false if the connection failed
+static bool connectionWrite(HTTPConnection &conn, const char *data, size_t len) {
+    while (len > 0) {
+        int chunk = len > INT_MAX ? INT_MAX : (int)len;
+        int sent;
+#ifndef REQUESTS_NO_TLS
+        if (conn.ssl != NULL) {
+            SigpipeGuard sigpipe;
+            sent = SSL_write(conn.ssl, data, chunk);
+        } else {
+            sent = send(conn.sock, data, chunk, SEND_FLAGS);
         }
-        response += string(buf, bytesReceived);
-        if (SSL_pending(ssl) < 1) {
-            break;
+#else
+        sent = send(conn.sock, data, chunk, SEND_FLAGS);
+#endif
+        if (sent <= 0) {
+            conn.error = ERROR_WRITE;
+            return false;
         }
+        conn.bytesSent += sent;
+        data += sent;
+        len -= sent;
     }
+    return true;
+}
 
-    if (bytesReceived < 0) {
-        BIO_free_all(bio);
-        SSL_CTX_free(ctx);
-        return "";
+//Reads up to len bytes from conn, returns <= 0 on close or error
+static int connectionRead(HTTPConnection &conn, char *buffer, int len) {
+    int read;
+#ifndef REQUESTS_NO_TLS
+    if (conn.ssl != NULL) {
+        //TLS 1.3 reads can answer a key update, which writes
+        SigpipeGuard sigpipe;
+        read = SSL_read(conn.ssl, buffer, len);
+    } else {
+        read = recv(conn.sock, buffer, len, 0);
     }
-    BIO_free_all(bio);
-    SSL_CTX_free(ctx);
-    return response;
+#else
+    read = recv(conn.sock, buffer, len, 0);
 #endif
+    if (read > 0) {
+        if (conn.bytesReceived == 0) {
+            conn.firstByte = std::chrono::steady_clock::now();
+        }
+        conn.bytesReceived += read;
+    }
+    return read;
 }
 
-string send_payload(string host, int port, string packet) {
-    if (!is_ip_address(host)) {
-        host = resolvdnsname(host);
+//Phases of a request timed by the metrics registry
+enum HTTPPhase {
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_SEND,
+    PHASE_WAIT,
+    PHASE_RECEIVE,
+    PHASE_TOTAL,
+    PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = { "dns", "connect", "tls", "send", "wait", "receive", "total" };
+
+//Upper bounds of the latency histogram buckets in seconds, the last bucket is +Inf
+#define METRICS_BUCKETS 15
+static const double bucket_bounds[METRICS_BUCKETS] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+
+//Number of distinct host:port entries, further hosts share the "other" entry
+#define METRICS_HOSTS 256
+
+//Struct defining a latency histogram, all updates are relaxed atomic adds
+struct PhaseHistogram {
+    std::atomic<unsigned long long> buckets[METRICS_BUCKETS + 1];
+    std::atomic<unsigned long long> sumMicros;
+    std::atomic<unsigned long long> count;
+};
+
+//Struct defining the metrics of one host:port
+//state goes 0 (free) -> 1 (key being written) -> 2 (ready) once, so lookups never take a lock
+struct HostMetrics {
+    std::atomic<int> state;
+    string key;
+    std::atomic<unsigned long long> requests;
+    std::atomic<unsigned long long> errors[ERROR_KIND_COUNT];
+    std::atomic<unsigned long long> bytesSent;
+    std::atomic<unsigned long long> bytesReceived;
+    std::atomic<unsigned long long> connectionsOpened;
+    std::atomic<unsigned long long> connectionsReused;
+    std::atomic<unsigned long long> tlsHandshakes;
+    std::atomic<unsigned long long> dnsLookups;
+    PhaseHistogram phases[PHASE_COUNT];
+};
+
+//Open addressed table of host metrics, the extra entry collects hosts once the table is full
+static HostMetrics host_metrics[METRICS_HOSTS + 1];
+
+//Returns the metrics entry of host:port, claiming a free entry on first use
+static HostMetrics &getHostMetrics(const string &host, int port) {
+    string key = host + ":" + std::to_string(port);
+    size_t start = std::hash<string>()(key) % METRICS_HOSTS;
+    for (size_t i = 0; i < METRICS_HOSTS; i++) {
+        HostMetrics &entry = host_metrics[(start + i) % METRICS_HOSTS];
+        int state = entry.state.load(std::memory_order_acquire);
+        if (state == 0) {
+            if (entry.state.compare_exchange_strong(state, 1, std::memory_order_acquire)) {
+                entry.key = key;
+                entry.state.store(2, std::memory_order_release);
+                return entry;
+            }
+        }
+        //Another thread is publishing this entry, its key is readable once it is ready
+        while (state == 1) {
+            std::this_thread::yield();
+            state = entry.state.load(std::memory_order_acquire);
+        }
+        if (entry.key == key) {
+            return entry;
+        }
     }
-#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
-    string result;
-    int sockfd;
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    sa.sin_addr.s_addr = inet_addr(host.c_str());
-    socklen_t socklen = sizeof(sa);
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        return "";
+    HostMetrics &other = host_metrics[METRICS_HOSTS];
+    int expected = 0;
+    if (other.state.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+        other.key = "other";
+        other.state.store(2, std::memory_order_release);
     }
-    if (connect(sockfd, (struct sockaddr *)&sa , socklen) < 0) {
-        return "";
+    return other;
+}
+
+//Adds one sample in milliseconds to a histogram
+static void observePhase(PhaseHistogram &histogram, double ms) {
+    double seconds = ms / 1000.0;
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS && seconds > bucket_bounds[bucket]) {
+        bucket++;
     }
-    int sent = send(sockfd, packet.c_str(), packet.length(), 0);
-    if (sent < 0) {
-        return "";
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram.sumMicros.fetch_add((unsigned long long)(ms * 1000.0), std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+//Counts a request the limiter refused to send
+static void recordRejectedRequest(const string &host, int port) {
+    HostMetrics &metrics = getHostMetrics(host, port);
+    metrics.requests.fetch_add(1, std::memory_order_relaxed);
+    metrics.errors[ERROR_REJECTED].fetch_add(1, std::memory_order_relaxed);
+}
+
+//Adds the dns, connect and tls handshake of conn to metrics, if conn went through them
+static void recordConnectionSetup(HostMetrics &metrics, const HTTPConnection &conn) {
+    const std::memory_order relaxed = std::memory_order_relaxed;
+    if (conn.dnsLookup) {
+        metrics.dnsLookups.fetch_add(1, relaxed);
+        observePhase(metrics.phases[PHASE_DNS], conn.dnsMs);
     }
-    char buffer[4096];
-    while (true) {
-        int read = recv(sockfd, buffer, 4096, 0);
-        result += string(buffer, read);
-        if (read < 4096) {
-            break;
-        }
+    if (conn.opened) {
+        metrics.connectionsOpened.fetch_add(1, relaxed);
+        observePhase(metrics.phases[PHASE_CONNECT], conn.connectMs);
     }
-    CloseSocket(sockfd);
-    return result;
-#else
-    WSADATA wsaData;
-    SOCKET sock = INVALID_SOCKET;
-    struct addrinfo *result = NULL, *ptr = NULL, hints;
-    int iResult;
-    int recvbuflen = 4096;
-    iResult = WSAStartup(MAKEWORD(2,2), &wsaData);
-    if (iResult != 0) {
-        return "";
+    if (conn.tlsHandshake) {
+        metrics.tlsHandshakes.fetch_add(1, relaxed);
+        observePhase(metrics.phases[PHASE_TLS], conn.tlsMs);
     }
-    ZeroMemory( &hints, sizeof(hints) );
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+}
 
-    iResult = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
-    if ( iResult != 0 ) {
-        WSACleanup();
-        return "";
+//Adds the counters and phase timings of a finished request on conn to the metrics of host:port
+//sent is the time the request was written, or a default time_point if it never was
+static void recordConnectionMetrics(const string &host, int port, const HTTPConnection &conn, std::chrono::steady_clock::time_point started, std::chrono::steady_clock::time_point sent) {
+    const std::memory_order relaxed = std::memory_order_relaxed;
+    HostMetrics &metrics = getHostMetrics(host, port);
+    metrics.requests.fetch_add(1, relaxed);
+    if (conn.error != ERROR_NONE) {
+        metrics.errors[conn.error].fetch_add(1, relaxed);
     }
-    for(ptr=result; ptr != NULL ;ptr=ptr->ai_next) {
-        sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-        if (sock == INVALID_SOCKET) {
-            WSACleanup();
-            return "";
+    metrics.bytesSent.fetch_add(conn.bytesSent, relaxed);
+    metrics.bytesReceived.fetch_add(conn.bytesReceived, relaxed);
+    if (conn.reused) {
+        metrics.connectionsReused.fetch_add(1, relaxed);
+    }
+    recordConnectionSetup(metrics, conn);
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point unset;
+    if (sent != unset) {
+        observePhase(metrics.phases[PHASE_SEND], std::chrono::duration<double, std::milli>(sent - conn.sendStart).count());
+        if (conn.firstByte != unset) {
+            observePhase(metrics.phases[PHASE_WAIT], std::chrono::duration<double, std::milli>(conn.firstByte - sent).count());
+            observePhase(metrics.phases[PHASE_RECEIVE], std::chrono::duration<double, std::milli>(now - conn.firstByte).count());
         }
-        iResult = connect( sock, ptr->ai_addr, (int)ptr->ai_addrlen);
-        if (iResult == SOCKET_ERROR) {
-            CloseSocket(sock);
-            sock = INVALID_SOCKET;
-            continue;
+    }
+    observePhase(metrics.phases[PHASE_TOTAL], std::chrono::duration<double, std::milli>(now - started).count());
+}
+
+//Escapes a Prometheus label value
+static string escapeLabel(const string &value) {
+    string result;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            result += '\\';
+            result += c;
+        } else if (c == '\n') {
+            result += "\\n";
+        } else {
+            result += c;
         }
-        break;
     }
-    freeaddrinfo(result);
-    if (sock == INVALID_SOCKET) {
-        WSACleanup();
-        return "";
+    return result;
+}
+
+//Will render the library metrics in the Prometheus text exposition format
+string renderPrometheusMetrics() {
+    struct Counter {
+        const char *name;
+        const char *help;
+        std::atomic<unsigned long long> HostMetrics::*field;
+    };
+    static const Counter counters[] = {
+        { "httprequests_requests_total", "Requests dispatched", &HostMetrics::requests },
+        { "httprequests_sent_bytes_total", "Bytes written to connections", &HostMetrics::bytesSent },
+        { "httprequests_received_bytes_total", "Bytes read from connections", &HostMetrics::bytesReceived },
+        { "httprequests_connections_opened_total", "Connections opened", &HostMetrics::connectionsOpened },
+        { "httprequests_connections_reused_total", "Requests sent on an already open connection", &HostMetrics::connectionsReused },
+        { "httprequests_tls_handshakes_total", "TLS handshakes completed", &HostMetrics::tlsHandshakes },
+        { "httprequests_dns_lookups_total", "DNS lookups", &HostMetrics::dnsLookups },
+    };
+    std::vector<HostMetrics *> hosts;
+    for (HostMetrics &entry : host_metrics) {
+        if (entry.state.load(std::memory_order_acquire) == 2) {
+            hosts.push_back(&entry);
+        }
     }
-    iResult = send(sock, packet.c_str(), packet.size(), 0);
-    if (iResult == SOCKET_ERROR) {
-        CloseSocket(sock);
-        WSACleanup();
-        return "";
+    std::ostringstream out;
+    for (const Counter &counter : counters) {
+        out << "# HELP " << counter.name << " " << counter.help << "\n";
+        out << "# TYPE " << counter.name << " counter\n";
+        for (HostMetrics *host : hosts) {
+            out << counter.name << "{host=\"" << escapeLabel(host->key) << "\"} " << (host->*counter.field).load(std::memory_order_relaxed) << "\n";
+        }
     }
-    char recvbuf[4096];
-    string response = "";
-    int received = 0;
-    while ((received = recv(sock, recvbuf, recvbuflen, 0)) > 0) {
-        response += string(recvbuf, received);
+    out << "# HELP httprequests_errors_total Failed requests by kind\n";
+    out << "# TYPE httprequests_errors_total counter\n";
+    for (HostMetrics *host : hosts) {
+        for (int kind = ERROR_NONE + 1; kind < ERROR_KIND_COUNT; kind++) {
+            out << "httprequests_errors_total{host=\"" << escapeLabel(host->key) << "\",kind=\"" << error_kind_names[kind] << "\"} "
+                << host->errors[kind].load(std::memory_order_relaxed) << "\n";
+        }
     }
-    CloseSocket(sock);
-    WSACleanup();
-    return response;
+    out << "# HELP httprequests_phase_duration_seconds Time spent in each phase of a request\n";
+    out << "# TYPE httprequests_phase_duration_seconds histogram\n";
+    for (HostMetrics *host : hosts) {
+        string host_label = "host=\"" + escapeLabel(host->key) + "\",phase=\"";
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            PhaseHistogram &histogram = host->phases[phase];
+            string labels = host_label + phase_names[phase] + "\"";
+            unsigned long long cumulative = 0;
+            for (int bucket = 0; bucket <= METRICS_BUCKETS; bucket++) {
+                cumulative += histogram.buckets[bucket].load(std::memory_order_relaxed);
+                out << "httprequests_phase_duration_seconds_bucket{" << labels << ",le=\"";
+                if (bucket < METRICS_BUCKETS) {
+                    out << bucket_bounds[bucket];
+                } else {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "httprequests_phase_duration_seconds_sum{" << labels << "} " << histogram.sumMicros.load(std::memory_order_relaxed) / 1e6 << "\n";
+            out << "httprequests_phase_duration_seconds_count{" << labels << "} " << cumulative << "\n";
+        }
+    }
+    return out.str();
+}
+
+//Waits up to timeoutMs for data, a close or an error on conn, returns false on timeout
+static bool waitReadable(HTTPConnection &conn, int timeoutMs) {
+#ifndef REQUESTS_NO_TLS
+    //Decrypted bytes already buffered by OpenSSL never show up on the socket
+    if (conn.ssl != NULL && SSL_pending(conn.ssl) > 0) {
+        return true;
+    }
+#endif
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+    struct pollfd pfd;
+    pfd.fd = conn.sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeoutMs) != 0;
+#else
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(conn.sock, &readable);
+    struct timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+    return select(0, &readable, NULL, NULL, &timeout) != 0;
 #endif
 }
 
+//Returns the Host header value, the port is only included when it is not the scheme default
+static string hostHeader(const string &host, int port, bool isSsl) {
+    if (port == (isSsl ? 443 : 80)) {
+        return host;
+    }
+    return host + ":" + std::to_string(port);
+}
+
 //Will encode a HTTPGetRequest struct to a payload string
 string encode_payload(HTTPGetRequest request) {
     string result;
     result += "GET " + request.path + " HTTP/1.1\r\n";
-    result += "Host: " + request.host + "\r\n";
+    result += "Host: " + hostHeader(request.host, request.port, request.isSsl) + "\r\n";
     //Go through each header
     for (auto header : request.headers) {
         result += header.first + ": " + header.second + "\r\n";
@@ -365,45 +899,12 @@ string encode_payload(HTTPGetRequest request) {
     return result;
 }
 
-//Will decode a HTTP response string to a HTTPResponse struct
-HTTPResponse decodePacket(string packet) {
-    HTTPResponse response;
-    response.headers = std::map<string, string>();
-    //Split packet into lines
-    std::vector<string> lines = split(packet, '\n');
-    //Get first line
-    string firstline = lines[0];
-    //Split first line into parts
-    std::vector<string> firstlineparts = split(firstline, ' ');
-    //Get status code
-    response.status_code = stoi(firstlineparts[1]);
-
-    
-    int currentIndex = 1;
-    for (int i = 1; i < lines.size(); i++) {
-        currentIndex +=1;
-        if (lines[i] == "\r") {
-            break;
-        }
-        std::vector<string> headerparts = split(lines[i], ':');
-        response.headers[headerparts[0]] = headerparts[1];
-    }
-    //Get body
-    string body = "";
-    for (int i = currentIndex; i < lines.size(); i++) {
-        body += lines[i];
-    }
-    response.body = body;
-    return response;
-
-}
-
 //Will encode a HTTPPostRequest struct to a payload string
 string encode_payload(HTTPPostRequest request) {
     string result;
     std::stringstream ss;
     ss << ("POST " + request.path + " HTTP/1.1\r\n");
-    ss << ("Host: " + request.host + "\r\n");
+    ss << ("Host: " + hostHeader(request.host, request.port, request.isSsl) + "\r\n");
     //Go through each header
     for (auto header : request.headers) {
         ss << (header.first + ": " + header.second + "\r\n");
@@ -423,117 +924,184 @@ void addHeader(HTTPPostRequest &request, string key, string value) {
     request.headers[key] = value;
 }
 
-//Will create a HTTPGetRequest struct
-HTTPGetRequest CreateGetRequest(string url, bool acceptJson) {
-    HTTPGetRequest request;
-    request.headers = std::map<string, string>();
-    request.sslVerify = true;
-    request.url = url;
-    bool isSsl = false;
-    string protocol = "http";
-    int port;
-    string urltoparse = url;
-    
-    if (urltoparse.find("https://") == 0) {
-        isSsl = true;
-        protocol = "https";
-        urltoparse = urltoparse.substr(8);
-        port = 443;
-    } else {
-        urltoparse = urltoparse.substr(7);
-        port = 80;
+//Percent-decodes a URL component
+static string percentDecode(std::string_view text) {
+    string result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '%' && i + 2 < text.size() && isxdigit((unsigned char)text[i + 1]) && isxdigit((unsigned char)text[i + 2])) {
+            char hex[3] = { text[i + 1], text[i + 2], 0 };
+            result += (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            result += text[i];
+        }
     }
-    request.isSsl = isSsl;
-    string hostname;
-    string subroute;
-    string ipaddr;
+    return result;
+}
 
-    if (urltoparse.find(":") != -1) {
-        if (urltoparse.find("/") == -1) {
-            urltoparse = urltoparse + "/";
-        }
-        int slashIndex = urltoparse.find("/");
-        subroute = urltoparse.substr(slashIndex);
-        int colonIndex = urltoparse.find(":");
-        port = stoi(urltoparse.substr(colonIndex + 1, slashIndex - colonIndex - 1));
-        hostname = urltoparse.substr(0, colonIndex);
-    } else {
-        if (urltoparse.find("/") == -1) {
-            urltoparse = urltoparse + "/";
+//Base64 encodes data (RFC 4648, with padding)
+static string base64Encode(std::string_view data) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string result;
+    result.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+        unsigned int n = ((unsigned char)data[i] << 16) | ((unsigned char)data[i + 1] << 8) | (unsigned char)data[i + 2];
+        result += alphabet[(n >> 18) & 63];
+        result += alphabet[(n >> 12) & 63];
+        result += alphabet[(n >> 6) & 63];
+        result += alphabet[n & 63];
+    }
+    if (i < data.size()) {
+        unsigned int n = (unsigned char)data[i] << 16;
+        if (i + 1 < data.size()) {
+            n |= (unsigned char)data[i + 1] << 8;
         }
-        int slashIndex = urltoparse.find("/");
-        subroute = urltoparse.substr(slashIndex);
-        hostname = urltoparse.substr(0, slashIndex);
+        result += alphabet[(n >> 18) & 63];
+        result += alphabet[(n >> 12) & 63];
+        result += i + 1 < data.size() ? alphabet[(n >> 6) & 63] : '=';
+        result += '=';
     }
-    request.port = port;
-    request.host = hostname;
-    request.path = subroute;
+    return result;
+}
 
-    if (!is_ip_address(hostname)) {
-        request.ipaddr = resolvdnsname(hostname);
-    } else {
-        request.ipaddr = hostname;
+//Will split url into its RFC 3986 components without copying
+bool parseURL(std::string_view url, URLView &view) {
+    view = URLView();
+    std::string_view rest = url;
+    size_t schemeEnd = rest.find("://");
+    if (schemeEnd != std::string_view::npos) {
+        view.scheme = rest.substr(0, schemeEnd);
+        rest.remove_prefix(schemeEnd + 3);
     }
-
-    addHeader(request, "User-Agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0.3538.102 Safari/537.36");
-    if (acceptJson == true) {
-        addHeader(request, "Accept", "application/json");
+    size_t hash = rest.find('#');
+    if (hash != std::string_view::npos) {
+        view.fragment = rest.substr(hash + 1);
+        rest = rest.substr(0, hash);
     }
-    request.method = "GET";
-    return request;
+    size_t question = rest.find('?');
+    if (question != std::string_view::npos) {
+        view.query = rest.substr(question + 1);
+        rest = rest.substr(0, question);
+    }
+    size_t slash = rest.find('/');
+    std::string_view authority = rest.substr(0, slash);
+    if (slash != std::string_view::npos) {
+        view.path = rest.substr(slash);
+    }
+    size_t at = authority.rfind('@');
+    if (at != std::string_view::npos) {
+        view.userinfo = authority.substr(0, at);
+        authority.remove_prefix(at + 1);
+    }
+    size_t portStart = std::string_view::npos;
+    if (!authority.empty() && authority[0] == '[') {
+        //IPv6 literal, the brackets are not part of the host
+        size_t close = authority.find(']');
+        if (close == std::string_view::npos) {
+            return false;
+        }
+        view.host = authority.substr(1, close - 1);
+        if (close + 1 < authority.size()) {
+            if (authority[close + 1] != ':') {
+                return false;
+            }
+            portStart = close + 2;
+        }
+    } else {
+        size_t colon = authority.find(':');
+        view.host = authority.substr(0, colon);
+        if (colon != std::string_view::npos) {
+            portStart = colon + 1;
+        }
+    }
+    if (portStart != std::string_view::npos) {
+        view.port = authority.substr(portStart);
+        if (view.port.empty() || view.port.size() > 5 || view.port.find_first_not_of("0123456789") != std::string_view::npos) {
+            return false;
+        }
+        //Five digits still allow ports past the 16 bit range
+        int port = 0;
+        for (char digit : view.port) {
+            port = port * 10 + (digit - '0');
+        }
+        if (port > 65535) {
+            return false;
+        }
+    }
+    return !view.host.empty();
 }
 
-//Will create a HTTPPostRequest struct
-HTTPPostRequest CreateJsonPostRequest(string url, string jsonpayload) {
-    HTTPPostRequest request;
+//Fills the connection fields of a request struct from url
+//DNS names are left in host and resolved when the request is dispatched
+template <typename Request>
+static void setRequestURL(Request &request, const string &url) {
     request.headers = std::map<string, string>();
-    bool isSsl = false;
-    request.sslVerify = true;
     request.url = url;
-    string protocol = "http";
-    int port;
-    string urltoparse = url;
-    
-    if (urltoparse.find("https://") == 0) {
-        isSsl = true;
-        protocol = "https";
-        urltoparse = urltoparse.substr(8);
-        port = 443;
-    } else {
-        urltoparse = urltoparse.substr(7);
-        port = 80;
+    request.sslVerify = true;
+    URLView view;
+    if (!parseURL(url, view)) {
+        request.isSsl = false;
+        request.port = 0;
+        return;
     }
-    request.isSsl = isSsl;
-    string hostname;
-    string subroute;
-    string ipaddr;
-
-    if (urltoparse.find(":") != -1) {
-        if (urltoparse.find("/") == -1) {
-            urltoparse = urltoparse + "/";
+    string scheme(view.scheme);
+    for (char &c : scheme) {
+        c = tolower((unsigned char)c);
+    }
+    request.isSsl = scheme == "https" || scheme == "wss" || scheme == "https+unix";
+    request.protocol = request.isSsl ? "https" : "http";
+    request.port = request.isSsl ? 443 : 80;
+    request.socketPath.clear();
+    if (scheme == "http+unix" || scheme == "https+unix") {
+        //The percent encoded socket path takes the place of the host, http+unix://%2Frun%2Fapp.sock/path
+        request.socketPath = percentDecode(view.host);
+        request.host = "localhost";
+        request.ipaddr = "";
+        request.path = view.path.empty() ? "/" : string(view.path);
+        if (!view.query.empty()) {
+            request.path += "?";
+            request.path += view.query;
         }
-        int slashIndex = urltoparse.find("/");
-        subroute = urltoparse.substr(slashIndex);
-        int colonIndex = urltoparse.find(":");
-        port = stoi(urltoparse.substr(colonIndex + 1, slashIndex - colonIndex - 1));
-        hostname = urltoparse.substr(0, colonIndex);
+        return;
+    }
+    if (!view.port.empty()) {
+        request.port = atoi(string(view.port).c_str());
+    }
+    if (view.host.find(':') != std::string_view::npos) {
+        request.host = "[" + string(view.host) + "]";
     } else {
-        if (urltoparse.find("/") == -1) {
-            urltoparse = urltoparse + "/";
-        }
-        int slashIndex = urltoparse.find("/");
-        subroute = urltoparse.substr(slashIndex);
-        hostname = urltoparse.substr(0, slashIndex);
+        request.host = string(view.host);
     }
-    request.port = port;
-    request.host = hostname;
-    request.path = subroute;
+    request.path = view.path.empty() ? "/" : string(view.path);
+    if (!view.query.empty()) {
+        request.path += "?";
+        request.path += view.query;
+    }
+    request.ipaddr = is_ip_address(string(view.host)) ? string(view.host) : "";
+    if (!view.userinfo.empty()) {
+        request.headers["Authorization"] = "Basic " + base64Encode(percentDecode(view.userinfo));
+    }
+}
 
-    if (!is_ip_address(hostname)) {
-        request.ipaddr = resolvdnsname(hostname);
-    } else {
-        request.ipaddr = hostname;
+//Will create a HTTPGetRequest struct
+HTTPGetRequest CreateGetRequest(string url, bool acceptJson) {
+    HTTPGetRequest request;
+    setRequestURL(request, url);
+
+    addHeader(request, "User-Agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0.3538.102 Safari/537.36");
+    if (acceptJson == true) {
+        addHeader(request, "Accept", "application/json");
     }
+    request.method = "GET";
+    return request;
+}
+
+//Will create a HTTPPostRequest struct
+HTTPPostRequest CreateJsonPostRequest(string url, string jsonpayload) {
+    HTTPPostRequest request;
+    setRequestURL(request, url);
 
     addHeader(request, "User-Agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0.3538.102 Safari/537.36");
     addHeader(request, "Content-Type", "application/json");
@@ -545,7 +1113,7 @@ HTTPPostRequest CreateJsonPostRequest(string url, string jsonpayload) {
 }
 
 // Generate a random string of numbers and letters "len" long
-string rand_string(int len) {
+static string rand_string(int len) {
     string str = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
     srand(time(0));
     string result = "";
@@ -555,7 +1123,7 @@ string rand_string(int len) {
     return result;
 }
 //Generate a random HTTP Multipart boundary
-string generateBoundary() {
+static string generateBoundary() {
     return rand_string(8) + "-"+rand_string(4)+"-"+rand_string(4)+"-"+rand_string(4)+"-"+rand_string(8);
 }
 
@@ -563,54 +1131,7 @@ string generateBoundary() {
 HTTPPostRequest CreateMimePostRequest(string url, string filename, string filedata) {
     //Create a random string that looks like: db54202a-dd6f-48e5-a433-0bf5805d201b
     HTTPPostRequest request;
-    request.headers = std::map<string, string>();
-    request.sslVerify = true;
-    request.url = url;
-    bool isSsl = false;
-    string protocol = "http";
-    int port;
-    string urltoparse = url;
-    
-    if (urltoparse.find("https://") == 0) {
-        isSsl = true;
-        protocol = "https";
-        urltoparse = urltoparse.substr(8);
-        port = 443;
-    } else {
-        urltoparse = urltoparse.substr(7);
-        port = 80;
-    }
-    request.isSsl = isSsl;
-    string hostname;
-    string subroute;
-    string ipaddr;
-
-    if (urltoparse.find(":") != -1) {
-        if (urltoparse.find("/") == -1) {
-            urltoparse = urltoparse + "/";
-        }
-        int slashIndex = urltoparse.find("/");
-        subroute = urltoparse.substr(slashIndex);
-        int colonIndex = urltoparse.find(":");
-        port = stoi(urltoparse.substr(colonIndex + 1, slashIndex - colonIndex - 1));
-        hostname = urltoparse.substr(0, colonIndex);
-    } else {
-        if (urltoparse.find("/") == -1) {
-            urltoparse = urltoparse + "/";
-        }
-        int slashIndex = urltoparse.find("/");
-        subroute = urltoparse.substr(slashIndex);
-        hostname = urltoparse.substr(0, slashIndex);
-    }
-    request.port = port;
-    request.host = hostname;
-    request.path = subroute;
-
-    if (!is_ip_address(hostname)) {
-        request.ipaddr = resolvdnsname(hostname);
-    } else {
-        request.ipaddr = hostname;
-    }
+    setRequestURL(request, url);
 
     string boundary = generateBoundary();
     addHeader(request, "User-Agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0.3538.102 Safari/537.36");
@@ -637,40 +1158,5110 @@ string getHeader(HTTPResponse &response, string key) {
     return response.headers[key];
 }
 
-//Will dispatch a HTTPGetRequest to the server and return a HTTPResponse
-HTTPResponse HTTPGet(HTTPGetRequest request) {
-    string payload = encode_payload(request);
-    string raw_response;
+#if !defined(REQUESTS_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define REQUESTS_X86_SIMD
+#include <immintrin.h>
+#endif
 
-    if (request.isSsl) {
-        raw_response = send_ssl_payload(request.ipaddr, request.port, payload, request.sslVerify);
-    } else {
-        raw_response = send_payload(request.ipaddr, request.port, payload);
+//Lookup table of the characters allowed in a header name (RFC 7230 tchar)
+static const char token_char_map[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+//Returns true for control characters that may not appear in a header line (HTAB is allowed)
+static inline bool is_ctl_char(unsigned char c) {
+    return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+//Returns the first byte in [buf, end) that is not a token character, or end
+static const char *scanTokenScalar(const char *buf, const char *end) {
+    while (buf < end && token_char_map[(unsigned char)*buf]) {
+        buf++;
     }
-    return decodePacket(raw_response);
+    return buf;
 }
 
-//Will dispatch a HTTPPostRequest to its server and return a HTTPResponse
-HTTPResponse HTTPPost(HTTPPostRequest request) {
-    string payload = encode_payload(request);
-    string raw_response;
+//Returns the first control character in [buf, end), or end
+static const char *scanTextScalar(const char *buf, const char *end) {
+    while (buf < end && !is_ctl_char((unsigned char)*buf)) {
+        buf++;
+    }
+    return buf;
+}
 
-    if (request.isSsl) {
-        raw_response = send_ssl_payload(request.ipaddr, request.port, payload, request.sslVerify);
-    } else {
-        raw_response = send_payload(request.ipaddr, request.port, payload);
+#ifdef REQUESTS_X86_SIMD
+//SSE4.2 kernels, PCMPESTRI stops on the first byte inside any of the given ranges
+//The token ranges also stop on '|' and '~', those are resolved by the scalar loop
+__attribute__((target("sse4.2")))
+static const char *scanTokenSSE42(const char *buf, const char *end) {
+    static const char ranges[16] = { '\x00', ' ', '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']', '{', '\xff' };
+    __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+    while (end - buf >= 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)buf);
+        int idx = _mm_cmpestri(r, 16, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_POSITIVE_POLARITY);
+        if (idx != 16) {
+            buf += idx;
+            if (token_char_map[(unsigned char)*buf]) {
+                buf++;
+                continue;
+            }
+            return buf;
+        }
+        buf += 16;
     }
-    return decodePacket(raw_response);
+    return scanTokenScalar(buf, end);
 }
 
-void test_get_google() {
-    HTTPGetRequest request = CreateGetRequest("https://www.google.com");
-    HTTPResponse response = HTTPGet(request);
-    std::cout << response.status_code << std::endl;
-    std::cout << response.body << std::endl;
-    if (response.status_code == 200) {
-        std::cout << "Success" << std::endl;
-    } else {
-        std::cout << "Failure" << std::endl;
+__attribute__((target("sse4.2")))
+static const char *scanTextSSE42(const char *buf, const char *end) {
+    static const char ranges[16] = { '\x00', '\x08', '\x0a', '\x1f', '\x7f', '\x7f' };
+    __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+    while (end - buf >= 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)buf);
+        int idx = _mm_cmpestri(r, 6, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_POSITIVE_POLARITY);
+        if (idx != 16) {
+            return buf + idx;
+        }
+        buf += 16;
+    }
+    return scanTextScalar(buf, end);
+}
+
+//AVX2 kernels, token characters are classified with a nibble lookup (two VPSHUFB per 32 bytes)
+__attribute__((target("avx2")))
+static const char *scanTokenAVX2(const char *buf, const char *end) {
+    //Bit h of token_lo[l] is set when the character 0xhl is a token character
+    const __m256i token_lo = _mm256_setr_epi8(
+        (char)0xe8, (char)0xfc, (char)0xf8, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc,
+        (char)0xf8, (char)0xf8, (char)0xf4, (char)0x54, (char)0xd0, (char)0x54, (char)0xf4, (char)0x70,
+        (char)0xe8, (char)0xfc, (char)0xf8, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc,
+        (char)0xf8, (char)0xf8, (char)0xf4, (char)0x54, (char)0xd0, (char)0x54, (char)0xf4, (char)0x70);
+    const __m256i token_hi = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0,
+        1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    while (end - buf >= 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)buf);
+        __m256i lo = _mm256_shuffle_epi8(token_lo, _mm256_and_si256(b, nibble));
+        __m256i hi = _mm256_shuffle_epi8(token_hi, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble));
+        __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(bad);
+        if (mask != 0) {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+    return scanTokenScalar(buf, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scanTextAVX2(const char *buf, const char *end) {
+    const __m256i limit = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (end - buf >= 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)buf);
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(b, limit), b);
+        ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, tab), ctl);
+        ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(b, del));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(ctl);
+        if (mask != 0) {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+    return scanTextScalar(buf, end);
+}
+#endif
+
+//Struct defining the header scanning kernels used by the response parser
+struct HeaderScanKernels {
+    const char *name;
+    const char *(*token)(const char *buf, const char *end);
+    const char *(*text)(const char *buf, const char *end);
+};
+
+static const HeaderScanKernels scalar_kernels = { "scalar", scanTokenScalar, scanTextScalar };
+#ifdef REQUESTS_X86_SIMD
+static const HeaderScanKernels sse42_kernels = { "sse4.2", scanTokenSSE42, scanTextSSE42 };
+static const HeaderScanKernels avx2_kernels = { "avx2", scanTokenAVX2, scanTextAVX2 };
+#endif
+
+//Picks the widest kernels supported by the running cpu
+static const HeaderScanKernels *detectHeaderScanKernels() {
+#ifdef REQUESTS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return &sse42_kernels;
+    }
+#endif
+    return &scalar_kernels;
+}
+
+//Kernels in use, chosen once at startup
+static const HeaderScanKernels *const header_scan = detectHeaderScanKernels();
+
+//States of the incremental response parser
+enum HTTPParseState {
+    PARSE_STATUS,
+    PARSE_HEADERS,
+    PARSE_BODY_LENGTH,
+    PARSE_BODY_CLOSE,
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_CHUNK_END,
+    PARSE_TRAILERS,
+    PARSE_DONE,
+    PARSE_ABORTED,
+    PARSE_ERROR
+};
+
+//Longest status, header or chunk size line the parser will buffer
+#define MAX_PARSER_LINE 65536
+
+//Struct defining the incremental response parser used by the streaming receive path
+//Only the current line is buffered, body bytes are handed to the handlers in place
+struct HTTPResponseParser {
+    HTTPStreamHandlers *handlers;
+    HTTPParseState state;
+    string line;
+    int status_code;
+    bool interim;
+    bool noBody;
+    bool chunked;
+    bool hasLength;
+    //Set once a 100 Continue has been received, it survives the reset for the final response
+    bool continued;
+    //Cleared when the server will close the connection after this response
+    bool keepAlive;
+    unsigned long long remaining;
+    //Size limits, 0 is unlimited, they survive the reset for the final response like continued
+    size_t maxHeaderBytes;
+    unsigned long long maxBodySize;
+    size_t headerBytes;
+    unsigned long long bodyBytes;
+    //Set when a limit ended the parse with PARSE_ERROR
+    bool limitExceeded;
+    //Kernels the lines are scanned with, header_scan unless a benchmark compares another
+    const HeaderScanKernels *scan;
+};
+
+//Resets parser to expect a new response, noBody is set for HEAD requests
+static void initResponseParser(HTTPResponseParser &parser, HTTPStreamHandlers &handlers, bool noBody) {
+    parser.handlers = &handlers;
+    parser.state = PARSE_STATUS;
+    parser.line.clear();
+    parser.status_code = 0;
+    parser.interim = false;
+    parser.noBody = noBody;
+    parser.chunked = false;
+    parser.hasLength = false;
+    parser.continued = false;
+    parser.keepAlive = false;
+    parser.remaining = 0;
+    parser.maxHeaderBytes = 0;
+    parser.maxBodySize = 0;
+    parser.headerBytes = 0;
+    parser.bodyBytes = 0;
+    parser.limitExceeded = false;
+    parser.scan = header_scan;
+}
+
+static std::mutex memory_lock;
+static std::condition_variable memory_released;
+static HTTPMemoryLimitsConfig memory_config;
+
+//Will set the default response size limits and the memory budget shared by buffered responses
+void setMemoryLimits(HTTPMemoryLimitsConfig config) {
+    std::lock_guard<std::mutex> guard(memory_lock);
+    memory_config = config;
+    //A larger budget may let waiting reads continue
+    memory_released.notify_all();
+}
+
+//Applies the size limits of a request to parser, a limit of 0 uses the setMemoryLimits default
+static void setResponseLimits(HTTPResponseParser &parser, size_t maxHeaderBytes, size_t maxBodySize) {
+    std::lock_guard<std::mutex> guard(memory_lock);
+    parser.maxHeaderBytes = maxHeaderBytes != 0 ? maxHeaderBytes : memory_config.maxHeaderBytes;
+    parser.maxBodySize = maxBodySize != 0 ? maxBodySize : memory_config.maxBodySize;
+}
+
+//Ends the parse because a response outgrew one of its limits
+static void exceedResponseLimit(HTTPResponseParser &parser) {
+    parser.limitExceeded = true;
+    parser.state = PARSE_ERROR;
+}
+
+//Case insensitive comparison used for header names
+static bool equalsIgnoreCase(const string &a, const char *b) {
+    size_t len = strlen(b);
+    if (a.size() != len) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Handles one complete line (without CRLF) for the non body states
+static void parseResponseLine(HTTPResponseParser &parser, const char *line, size_t len) {
+    HTTPStreamHandlers &handlers = *parser.handlers;
+    const char *end = line + len;
+    if (parser.state == PARSE_STATUS) {
+        const char *space = (const char *)memchr(line, ' ', len);
+        if (len < 5 || memcmp(line, "HTTP/", 5) != 0 || space == NULL) {
+            parser.state = PARSE_ERROR;
+            return;
+        }
+        parser.status_code = atoi(space + 1);
+        //HTTP/1.1 connections stay open unless the server says otherwise
+        parser.keepAlive = len >= 8 && memcmp(line, "HTTP/1.1", 8) == 0;
+        //Interim responses such as 100 Continue are skipped entirely
+        parser.interim = parser.status_code >= 100 && parser.status_code < 200 && parser.status_code != 101;
+        parser.state = PARSE_HEADERS;
+        if (!parser.interim && handlers.on_status && !handlers.on_status(parser.status_code)) {
+            parser.state = PARSE_ABORTED;
+        }
+        return;
+    }
+    if (parser.state == PARSE_HEADERS) {
+        if (len != 0) {
+            if (parser.interim) {
+                return;
+            }
+            const char *colon = parser.scan->token(line, end);
+            if (colon == line || colon == end || *colon != ':') {
+                parser.state = PARSE_ERROR;
+                return;
+            }
+            const char *value = colon + 1;
+            while (value < end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char *valueEnd = end;
+            while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+                valueEnd--;
+            }
+            string key(line, colon - line);
+            string val(value, valueEnd - value);
+            if (equalsIgnoreCase(key, "Transfer-Encoding")) {
+                parser.chunked = val.find("chunked") != string::npos;
+            } else if (equalsIgnoreCase(key, "Content-Length")) {
+                parser.hasLength = true;
+                parser.remaining = strtoull(val.c_str(), NULL, 10);
+                //Refused before any handler can size a buffer for it
+                if (parser.maxBodySize != 0 && parser.remaining > parser.maxBodySize) {
+                    exceedResponseLimit(parser);
+                    return;
+                }
+            } else if (equalsIgnoreCase(key, "Connection")) {
+                string token = val;
+                for (char &c : token) {
+                    c = tolower((unsigned char)c);
+                }
+                if (token.find("close") != string::npos) {
+                    parser.keepAlive = false;
+                } else if (token.find("keep-alive") != string::npos) {
+                    parser.keepAlive = true;
+                }
+            }
+            if (handlers.on_header && !handlers.on_header(key, val)) {
+                parser.state = PARSE_ABORTED;
+            }
+            return;
+        }
+        if (parser.interim) {
+            bool continued = parser.continued || parser.status_code == 100;
+            size_t maxHeaderBytes = parser.maxHeaderBytes;
+            unsigned long long maxBodySize = parser.maxBodySize;
+            //Interim responses count against the header limit of the final one
+            size_t headerBytes = parser.headerBytes;
+            const HeaderScanKernels *scan = parser.scan;
+            initResponseParser(parser, handlers, parser.noBody);
+            parser.scan = scan;
+            parser.continued = continued;
+            parser.maxHeaderBytes = maxHeaderBytes;
+            parser.maxBodySize = maxBodySize;
+            parser.headerBytes = headerBytes;
+            return;
+        }
+        if (parser.noBody || parser.status_code == 101 || parser.status_code == 204 || parser.status_code == 304) {
+            parser.state = PARSE_DONE;
+        } else if (parser.chunked) {
+            parser.state = PARSE_CHUNK_SIZE;
+        } else if (parser.hasLength) {
+            parser.state = parser.remaining == 0 ? PARSE_DONE : PARSE_BODY_LENGTH;
+        } else {
+            parser.state = PARSE_BODY_CLOSE;
+            parser.keepAlive = false;
+        }
+        if (parser.status_code == 101) {
+            parser.keepAlive = false;
+        }
+        return;
+    }
+    if (parser.state == PARSE_CHUNK_SIZE) {
+        //strtoull stops at the CR-less end of the line or at a chunk extension
+        string size(line, len);
+        char *sizeEnd;
+        parser.remaining = strtoull(size.c_str(), &sizeEnd, 16);
+        if (sizeEnd == size.c_str()) {
+            parser.state = PARSE_ERROR;
+            return;
+        }
+        parser.state = parser.remaining == 0 ? PARSE_TRAILERS : PARSE_CHUNK_DATA;
+        return;
+    }
+    if (parser.state == PARSE_CHUNK_END) {
+        parser.state = len == 0 ? PARSE_CHUNK_SIZE : PARSE_ERROR;
+        return;
+    }
+    if (parser.state == PARSE_TRAILERS && len == 0) {
+        parser.state = PARSE_DONE;
+    }
+}
+
+//Feeds len bytes of a response into parser, invoking the handlers as items complete
+//Returns the number of bytes consumed, which is less than len only once the response is done
+static size_t feedResponseParser(HTTPResponseParser &parser, const char *data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        HTTPParseState state = parser.state;
+        if (state == PARSE_DONE || state == PARSE_ABORTED || state == PARSE_ERROR) {
+            break;
+        }
+        if (state == PARSE_BODY_LENGTH || state == PARSE_CHUNK_DATA || state == PARSE_BODY_CLOSE) {
+            size_t take = len - pos;
+            if (state != PARSE_BODY_CLOSE && take > parser.remaining) {
+                take = (size_t)parser.remaining;
+            }
+            parser.bodyBytes += take;
+            if (parser.maxBodySize != 0 && parser.bodyBytes > parser.maxBodySize) {
+                exceedResponseLimit(parser);
+                break;
+            }
+            if (parser.handlers->on_body_chunk && !parser.handlers->on_body_chunk(std::string_view(data + pos, take))) {
+                parser.state = PARSE_ABORTED;
+                break;
+            }
+            pos += take;
+            if (state != PARSE_BODY_CLOSE) {
+                parser.remaining -= take;
+                if (parser.remaining == 0) {
+                    parser.state = state == PARSE_CHUNK_DATA ? PARSE_CHUNK_END : PARSE_DONE;
+                }
+            }
+            continue;
+        }
+        //Line based states, the scan stops on CR, LF or any invalid control character
+        const char *start = data + pos;
+        const char *stop = parser.scan->text(start, data + len);
+        if (stop != data + len && *stop != '\r' && *stop != '\n') {
+            parser.state = PARSE_ERROR;
+            break;
+        }
+        bool headerLine = state == PARSE_STATUS || state == PARSE_HEADERS || state == PARSE_TRAILERS;
+        if (stop == data + len || *stop == '\r') {
+            //Incomplete line, or a CR whose LF may be in the next read
+            bool crlf = stop + 1 < data + len && stop[0] == '\r' && stop[1] == '\n';
+            if (!crlf) {
+                if (stop + 1 < data + len) {
+                    parser.state = PARSE_ERROR;
+                    break;
+                }
+                parser.line.append(start, stop - start);
+                if (parser.line.size() > MAX_PARSER_LINE) {
+                    parser.state = PARSE_ERROR;
+                }
+                if (headerLine) {
+                    parser.headerBytes += stop - start;
+                    if (parser.maxHeaderBytes != 0 && parser.headerBytes > parser.maxHeaderBytes) {
+                        exceedResponseLimit(parser);
+                    }
+                }
+                pos = len;
+                break;
+            }
+            stop++;
+        }
+        size_t lineLen = (stop - start) - (stop > start && stop[-1] == '\r' ? 1 : 0);
+        pos = stop + 1 - data;
+        if (headerLine) {
+            parser.headerBytes += stop + 1 - start;
+            if (parser.maxHeaderBytes != 0 && parser.headerBytes > parser.maxHeaderBytes) {
+                exceedResponseLimit(parser);
+                break;
+            }
+        }
+        if (parser.line.empty()) {
+            //Whole line is inside the read buffer, parse it in place
+            parseResponseLine(parser, start, lineLen);
+        } else {
+            parser.line.append(start, lineLen);
+            parseResponseLine(parser, parser.line.data(), parser.line.size());
+            parser.line.clear();
+        }
+    }
+    return pos;
+}
+
+//Smallest and largest socket read sizes, reads grow while they keep filling the buffer
+#define MIN_READ_SIZE 4096
+#define MAX_READ_SIZE 65536
+//Buffers are sized at most this far ahead of the body bytes that arrived, an announced Content-Length alone allocates no more
+#define MAX_BODY_RESERVE ((size_t)4 << 20)
+
+//Bytes of buffered responses currently counted against the memory budget
+static size_t memory_in_flight = 0;
+//Responses holding part of the budget, and how many of them wait for more
+static int memory_holders = 0;
+static int memory_waiting = 0;
+
+//Struct defining the share of the memory budget held by one buffered response
+struct MemoryReservation {
+    bool enabled = false;
+    size_t held = 0;
+
+    ~MemoryReservation();
+};
+
+//Returns bytes to the memory budget and wakes reads waiting for it
+static void releaseMemory(MemoryReservation &reservation, size_t bytes) {
+    if (bytes == 0 || !reservation.enabled) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(memory_lock);
+    bytes = std::min(bytes, reservation.held);
+    reservation.held -= bytes;
+    memory_in_flight -= bytes;
+    if (reservation.held == 0) {
+        memory_holders--;
+    }
+    memory_released.notify_all();
+}
+
+MemoryReservation::~MemoryReservation() {
+    releaseMemory(*this, held);
+}
+
+//Returns the bytes reservation may still take before its response alone holds the whole memory budget
+static unsigned long long memoryRoom(const MemoryReservation &reservation) {
+    std::lock_guard<std::mutex> guard(memory_lock);
+    if (!reservation.enabled || memory_config.memoryBudget == 0) {
+        return ULLONG_MAX;
+    }
+    return memory_config.memoryBudget - std::min(reservation.held, memory_config.memoryBudget);
+}
+
+//Takes up to bytes from the memory budget before they are read, waiting while other responses hold it
+//Once every other holder is waiting as well the read goes ahead, so responses that fit the budget finish one at a time
+//A response never takes more than the whole budget, returns the bytes taken and 0 once it holds all of it
+static size_t acquireMemory(MemoryReservation &reservation, size_t bytes) {
+    if (!reservation.enabled || bytes == 0) {
+        return bytes;
+    }
+    std::unique_lock<std::mutex> guard(memory_lock);
+    if (memory_config.memoryBudget != 0) {
+        bytes = std::min(bytes, memory_config.memoryBudget - std::min(reservation.held, memory_config.memoryBudget));
+        if (bytes == 0) {
+            return 0;
+        }
+    }
+    while (memory_config.memoryBudget != 0 && memory_in_flight + bytes > memory_config.memoryBudget
+           && memory_waiting < memory_holders - (reservation.held > 0 ? 1 : 0)) {
+        memory_waiting++;
+        memory_released.wait(guard);
+        memory_waiting--;
+    }
+    if (reservation.held == 0) {
+        memory_holders++;
+    }
+    reservation.held += bytes;
+    memory_in_flight += bytes;
+    return bytes;
+}
+
+//Returns the bytes buffered responses hold of the memory budget
+size_t getMemoryInFlight() {
+    std::lock_guard<std::mutex> guard(memory_lock);
+    return memory_in_flight;
+}
+
+//Reads the rest of a Content-Length body straight into body, with no intermediate buffer
+//The body is sized up to MAX_BODY_RESERVE ahead of the bytes read and doubles as it fills,
+//each step is taken from the memory budget before it is allocated
+//A body that does not fit the budget on its own fails as over its limits before any of it is read
+static bool readBodyInto(HTTPConnection &conn, HTTPResponseParser &parser, string &body, MemoryReservation &reservation) {
+    if (parser.remaining > memoryRoom(reservation)) {
+        exceedResponseLimit(parser);
+        return false;
+    }
+    size_t start = body.size();
+    size_t offset = start;
+    while (parser.remaining > 0) {
+        if (offset == body.size()) {
+            size_t step = (size_t)std::min<unsigned long long>(parser.remaining, std::max(offset - start, MAX_BODY_RESERVE));
+            step = acquireMemory(reservation, step);
+            if (step == 0) {
+                exceedResponseLimit(parser);
+                return false;
+            }
+#ifdef __cpp_lib_string_resize_and_overwrite
+            //The reads below write every byte, so the new storage is not zero-filled first
+            body.resize_and_overwrite(offset + step, [](char *, size_t size) { return size; });
+#else
+            body.resize(offset + step);
+#endif
+        }
+        size_t want = std::min(body.size() - offset, (size_t)INT_MAX);
+        int read = connectionRead(conn, &body[offset], (int)want);
+        if (read <= 0) {
+            releaseMemory(reservation, body.size() - offset);
+            body.resize(offset);
+            return false;
+        }
+        offset += read;
+        parser.remaining -= read;
+    }
+    parser.state = PARSE_DONE;
+    return true;
+}
+
+//Reads the rest of the response parser has started on from conn, returns true if it was received completely
+//With bodySink set, the rest of a Content-Length body is read into it without calling on_body_chunk
+//and the buffered response counts against the memory budget until it is complete
+static bool continueResponse(HTTPConnection &conn, HTTPResponseParser &parser, string *bodySink) {
+    std::vector<char> buffer(MIN_READ_SIZE);
+    bool leftover = false;
+    MemoryReservation reservation;
+    reservation.enabled = bodySink != NULL;
+    while (parser.state != PARSE_DONE && parser.state != PARSE_ABORTED && parser.state != PARSE_ERROR) {
+        if (bodySink != NULL && parser.state == PARSE_BODY_LENGTH) {
+            readBodyInto(conn, parser, *bodySink, reservation);
+            break;
+        }
+        //Reads wait for the budget before they happen, the unread bytes stay in the socket and slow the server down
+        size_t want = acquireMemory(reservation, buffer.size());
+        if (want == 0) {
+            exceedResponseLimit(parser);
+            break;
+        }
+        int read = connectionRead(conn, buffer.data(), (int)want);
+        releaseMemory(reservation, want - (read > 0 ? read : 0));
+        if (read <= 0) {
+            //A body without framing is terminated by the server closing the connection
+            if (parser.state == PARSE_BODY_CLOSE) {
+                parser.state = PARSE_DONE;
+            }
+            break;
+        }
+        //Bytes past the end of the response mean the connection can not carry another request
+        leftover = feedResponseParser(parser, buffer.data(), read) < (size_t)read;
+        if (read == (int)want && buffer.size() < MAX_READ_SIZE) {
+            buffer.resize(buffer.size() * 2);
+        }
+    }
+    conn.reusable = parser.state == PARSE_DONE && parser.keepAlive && !leftover;
+    if (parser.limitExceeded) {
+        conn.error = ERROR_LIMIT;
+    } else if (parser.state == PARSE_ERROR) {
+        conn.error = ERROR_PARSE;
+    } else if (parser.state != PARSE_DONE && parser.state != PARSE_ABORTED) {
+        conn.error = ERROR_READ;
+    }
+    return parser.state == PARSE_DONE;
+}
+
+//Reads a response from conn into handlers, returns true if it was received completely
+static bool receiveResponse(HTTPConnection &conn, HTTPStreamHandlers &handlers, bool noBody, string *bodySink) {
+    HTTPResponseParser parser;
+    initResponseParser(parser, handlers, noBody);
+    setResponseLimits(parser, 0, 0);
+    return continueResponse(conn, parser, bodySink);
+}
+
+//Reads a whole raw response from conn, the response framing decides when to stop reading
+//Bytes are received straight into the result, which reserves up to MAX_BODY_RESERVE once the Content-Length is known
+//The setMemoryLimits defaults apply, a response over a limit returns ""
+static string receiveRawResponse(HTTPConnection &conn) {
+    string result;
+    HTTPStreamHandlers handlers;
+    HTTPResponseParser parser;
+    initResponseParser(parser, handlers, false);
+    setResponseLimits(parser, 0, 0);
+    MemoryReservation reservation;
+    reservation.enabled = true;
+    size_t readSize = MIN_READ_SIZE;
+    bool reserved = false;
+    while (parser.state != PARSE_DONE && parser.state != PARSE_ERROR) {
+        size_t offset = result.size();
+        size_t want = readSize;
+        if (parser.state == PARSE_BODY_LENGTH && parser.remaining < want) {
+            want = (size_t)parser.remaining;
+        }
+        want = acquireMemory(reservation, want);
+        if (want == 0) {
+            exceedResponseLimit(parser);
+            break;
+        }
+        result.resize(offset + want);
+        int read = connectionRead(conn, &result[offset], (int)want);
+        result.resize(offset + (read > 0 ? read : 0));
+        releaseMemory(reservation, want - (read > 0 ? read : 0));
+        if (read <= 0) {
+            break;
+        }
+        feedResponseParser(parser, result.data() + offset, read);
+        if (!reserved && parser.state == PARSE_BODY_LENGTH) {
+            if (parser.remaining > memoryRoom(reservation)) {
+                exceedResponseLimit(parser);
+                break;
+            }
+            result.reserve(result.size() + (size_t)std::min<unsigned long long>(parser.remaining, MAX_BODY_RESERVE));
+            reserved = true;
+        }
+        if (read == (int)want && readSize < MAX_READ_SIZE) {
+            readSize *= 2;
+        }
+    }
+    if (parser.limitExceeded) {
+        conn.error = ERROR_LIMIT;
+        return "";
+    }
+    if (parser.state != PARSE_DONE) {
+        conn.error = parser.state == PARSE_ERROR ? ERROR_PARSE : ERROR_READ;
+    }
+    return result;
+}
+
+//Opens a connection, sends packet and returns the raw response
+static string sendRawPayload(string host, int port, const string &packet, bool isSsl, bool verify) {
+    HTTPConnection conn;
+    auto started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point sent;
+    string result;
+    if (openConnection(conn, host, port, isSsl, verify, host)) {
+        conn.sendStart = std::chrono::steady_clock::now();
+        if (connectionWrite(conn, packet.data(), packet.size())) {
+            sent = std::chrono::steady_clock::now();
+            result = receiveRawResponse(conn);
+        }
+        closeConnection(conn);
+    }
+    recordConnectionMetrics(host, port, conn, started, sent);
+    return result;
+}
+
+//Will send a raw https packet and return a raw response
+string send_ssl_payload(string host, int port, string packet, bool verify) {
+    //Returns "" when built with REQUESTS_NO_TLS, openConnection refuses ssl
+    return sendRawPayload(host, port, packet, true, verify);
+}
+
+//Will send a raw http packet and return a raw response
+string send_payload(string host, int port, string packet) {
+    return sendRawPayload(host, port, packet, false, false);
+}
+
+//Will send a raw http packet over a unix domain socket and return a raw response
+string send_unix_payload(string socketPath, string packet) {
+    HTTPConnection conn;
+    auto started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point sent;
+    string result;
+    if (openUnixSocket(conn, socketPath)) {
+        conn.sendStart = std::chrono::steady_clock::now();
+        if (connectionWrite(conn, packet.data(), packet.size())) {
+            sent = std::chrono::steady_clock::now();
+            result = receiveRawResponse(conn);
+        }
+        closeConnection(conn);
+    }
+    recordConnectionMetrics("unix:" + socketPath, 0, conn, started, sent);
+    return result;
+}
+
+//Idle connections kept per route and how long they may sit unused
+#define POOL_MAX_IDLE 8
+#define POOL_IDLE_MS 30000
+//Connections a pool fill opens at the same time
+#define POOL_FILL_THREADS 8
+
+//Struct defining an idle connection parked in the pool
+struct PooledConnection {
+    HTTPConnection conn;
+    std::chrono::steady_clock::time_point idleSince;
+};
+
+static std::mutex pool_lock;
+static std::map<string, std::vector<PooledConnection>> connection_pool;
+//Idle connections kept for routes that preconnect or setMinIdleConnections asked more of than POOL_MAX_IDLE
+static std::map<string, size_t> pool_capacity;
+
+#ifndef REQUESTS_NO_TLS
+//Switches sock between blocking and non-blocking mode
+static void setSocketBlocking(SOCKET sock, bool blocking) {
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#else
+    u_long mode = blocking ? 0 : 1;
+    ioctlsocket(sock, FIONBIO, &mode);
+#endif
+}
+#endif
+
+//Returns false if the peer closed conn or sent data nobody asked for while it was idle
+static bool idleConnectionUsable(HTTPConnection &conn) {
+    if (!waitReadable(conn, 0)) {
+        return true;
+    }
+#ifndef REQUESTS_NO_TLS
+    //TLS 1.3 servers send session tickets after the handshake, a connection that was never used still has them
+    //unread, peeking processes them and only application data, an alert or a close makes it unusable
+    if (conn.ssl != NULL) {
+        setSocketBlocking(conn.sock, false);
+        char byte;
+        int peeked = SSL_peek(conn.ssl, &byte, 1);
+        bool usable = peeked <= 0 && SSL_get_error(conn.ssl, peeked) == SSL_ERROR_WANT_READ;
+        setSocketBlocking(conn.sock, true);
+        return usable;
     }
+#endif
+    return false;
+}
+
+//Lets the pool of route hold at least capacity idle connections
+static void raisePoolCapacity(const string &route, size_t capacity) {
+    std::lock_guard<std::mutex> guard(pool_lock);
+    size_t &current = pool_capacity[route];
+    current = std::max(current, capacity);
+}
+
+//Returns how many idle connections the pool of route may hold, pool_lock must be held
+static size_t poolLimit(const string &route) {
+    auto capacity = pool_capacity.find(route);
+    return capacity != pool_capacity.end() ? std::max((size_t)POOL_MAX_IDLE, capacity->second) : POOL_MAX_IDLE;
+}
+
+//Returns true if pooled has not expired and its peer has not closed it
+static bool pooledConnectionUsable(PooledConnection &pooled, std::chrono::steady_clock::time_point now) {
+    return now - pooled.idleSince < std::chrono::milliseconds(POOL_IDLE_MS) && idleConnectionUsable(pooled.conn);
+}
+
+//Closes the expired and broken idle connections of route and returns how many usable ones are left
+//The connections are probed outside pool_lock, requests for route open their own in the meantime
+static size_t countIdleConnections(const string &route) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<PooledConnection> idle;
+    {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        auto it = connection_pool.find(route);
+        if (it == connection_pool.end()) {
+            return 0;
+        }
+        idle.swap(it->second);
+    }
+    std::vector<HTTPConnection> stale;
+    for (size_t i = 0; i < idle.size();) {
+        if (pooledConnectionUsable(idle[i], now)) {
+            i++;
+        } else {
+            stale.push_back(idle[i].conn);
+            idle.erase(idle.begin() + i);
+        }
+    }
+    size_t count;
+    {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        //Connections parked while these were probed are more recent, so these go in front of them
+        std::vector<PooledConnection> &parked = connection_pool[route];
+        parked.insert(parked.begin(), idle.begin(), idle.end());
+        size_t limit = poolLimit(route);
+        while (parked.size() > limit) {
+            stale.push_back(parked.front().conn);
+            parked.erase(parked.begin());
+        }
+        count = parked.size();
+    }
+    for (HTTPConnection &old : stale) {
+        closeConnection(old);
+    }
+    return count;
+}
+
+//Moves an idle connection for route into conn, returns false if there is none
+//Each candidate is taken out of the pool first and probed outside pool_lock
+static bool takePooledConnection(const string &route, HTTPConnection &conn) {
+    auto now = std::chrono::steady_clock::now();
+    bool found = false;
+    while (!found) {
+        PooledConnection pooled;
+        {
+            std::lock_guard<std::mutex> guard(pool_lock);
+            auto it = connection_pool.find(route);
+            if (it == connection_pool.end() || it->second.empty()) {
+                return false;
+            }
+            //Most recently used first, it is the least likely to have been closed by the peer
+            pooled = it->second.back();
+            it->second.pop_back();
+        }
+        if (pooledConnectionUsable(pooled, now)) {
+            conn = pooled.conn;
+            found = true;
+        } else {
+            closeConnection(pooled.conn);
+        }
+    }
+    //The per request accounting starts over, only the transport state carries across
+    HTTPConnection fresh;
+    fresh.sock = conn.sock;
+    fresh.ctx = conn.ctx;
+    fresh.ssl = conn.ssl;
+    fresh.ktls = conn.ktls;
+    fresh.reused = true;
+    conn = fresh;
+    return true;
+}
+
+//Parks conn in the pool for route if its last response allows reuse, otherwise closes it
+static void releasePooledConnection(const string &route, HTTPConnection &conn) {
+    if (conn.sock == INVALID_SOCKET) {
+        return;
+    }
+    if (conn.reusable) {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        std::vector<PooledConnection> &idle = connection_pool[route];
+        if (idle.size() < poolLimit(route)) {
+            idle.push_back({ conn, std::chrono::steady_clock::now() });
+            conn.sock = INVALID_SOCKET;
+            conn.ctx = NULL;
+            conn.ssl = NULL;
+            return;
+        }
+    }
+    closeConnection(conn);
+}
+
+//Struct defining a handle that lets another thread abort an in-progress dispatch
+struct HTTPCancel {
+    std::mutex lock;
+    SOCKET sock = INVALID_SOCKET;
+    bool cancelled = false;
+};
+
+//Aborts the dispatch using cancel, a blocked read or write on its socket returns immediately
+static void cancelDispatch(HTTPCancel &cancel) {
+    std::lock_guard<std::mutex> guard(cancel.lock);
+    cancel.cancelled = true;
+    if (cancel.sock != INVALID_SOCKET) {
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+        shutdown(cancel.sock, SHUT_RDWR);
+#else
+        shutdown(cancel.sock, SD_BOTH);
+#endif
+    }
+}
+
+//Publishes the socket of a dispatch to its cancel handle, returns false if it was already cancelled
+static bool registerCancel(HTTPCancel *cancel, SOCKET sock) {
+    if (cancel == NULL) {
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(cancel->lock);
+    cancel->sock = sock;
+    return !cancel->cancelled;
+}
+
+//Struct defining where an encoded request is sent, filled from a request struct
+struct HTTPDispatch {
+    string ipaddr;
+    string host;
+    int port;
+    bool isSsl;
+    bool verify;
+    //Optional handle used to abort the dispatch from another thread
+    HTTPCancel *cancel = NULL;
+    //Optional string that Content-Length bodies are received into directly
+    string *bodySink = NULL;
+    //Set once the connection is open
+    bool ktlsActive = false;
+    //Proxy URL of the request, empty uses the setProxy configuration
+    string proxy;
+    //Optional producer of a chunked body sent after the payload
+    HTTPBodyProducer *producer = NULL;
+    //Length of the body at the end of the payload that waits for 100 Continue, and for how long
+    size_t heldBody = 0;
+    int continueTimeoutMs = 0;
+    //Response size limits of the request, 0 uses the setMemoryLimits defaults
+    size_t maxHeaderBytes = 0;
+    size_t maxBodySize = 0;
+    //Unix domain socket the request is sent to instead of ipaddr:port
+    string socketPath;
+    //Set for responses streamed to handlers, which last as long as the caller keeps reading
+    bool streamed = false;
+};
+
+//Builds the dispatch target of a HTTPGetRequest or HTTPPostRequest
+template <typename Request>
+static HTTPDispatch dispatchTarget(const Request &request) {
+    HTTPDispatch target;
+    //Requests built from a dns name are resolved when they are sent, not when they are created
+    target.ipaddr = request.ipaddr.empty() ? request.host : request.ipaddr;
+    target.host = request.host;
+    target.port = request.port;
+    target.isSsl = request.isSsl;
+    target.verify = request.sslVerify;
+    target.proxy = request.proxy;
+    target.maxHeaderBytes = request.maxHeaderBytes;
+    target.maxBodySize = request.maxBodySize;
+    target.socketPath = request.socketPath;
+    return target;
+}
+
+//Struct defining the proxy hop of a dispatch
+struct ProxyRoute {
+    string host;
+    int port = 0;
+    string authorization;
+};
+
+static std::mutex proxy_lock;
+static HTTPProxyConfig proxy_config;
+
+//Will set the proxies used by requests that do not name their own
+void setProxy(HTTPProxyConfig config) {
+    std::lock_guard<std::mutex> guard(proxy_lock);
+    proxy_config = config;
+}
+
+//Returns the value of the first of names that is set in the environment
+static string environmentValue(std::initializer_list<const char *> names) {
+    for (const char *name : names) {
+        const char *value = getenv(name);
+        if (value != NULL && *value != 0) {
+            return value;
+        }
+    }
+    return "";
+}
+
+//Will read the proxy settings from http_proxy, https_proxy and no_proxy
+HTTPProxyConfig proxyFromEnvironment() {
+    HTTPProxyConfig config;
+    //The lower case names win, like in curl
+    config.httpProxy = environmentValue({ "http_proxy", "HTTP_PROXY" });
+    config.httpsProxy = environmentValue({ "https_proxy", "HTTPS_PROXY" });
+    config.noProxy = environmentValue({ "no_proxy", "NO_PROXY" });
+    return config;
+}
+
+//Returns true if host matches an entry of noProxy, a comma separated list of hosts and domain suffixes
+static bool bypassesProxy(string host, const string &noProxy) {
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    for (char &c : host) {
+        c = tolower((unsigned char)c);
+    }
+    for (string entry : split(noProxy, ',')) {
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+        for (char &c : entry) {
+            c = tolower((unsigned char)c);
+        }
+        if (entry == "*") {
+            return true;
+        }
+        //Ports are ignored, an entry matches every port of its host
+        if (!entry.empty() && entry.front() == '[') {
+            entry = entry.substr(1, entry.find(']') - 1);
+        } else if (std::count(entry.begin(), entry.end(), ':') == 1) {
+            entry = entry.substr(0, entry.find(':'));
+        }
+        if (!entry.empty() && entry.front() == '.') {
+            entry.erase(0, 1);
+        }
+        if (entry.empty()) {
+            continue;
+        }
+        if (host == entry || (host.size() > entry.size() && host.compare(host.size() - entry.size() - 1, string::npos, "." + entry) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Fills route with the proxy target is sent through, returns false for a direct connection
+//A malformed proxy URL leaves route.port 0 so the request fails instead of bypassing the proxy
+static bool proxyRoute(const HTTPDispatch &target, ProxyRoute &route) {
+    //Unix domain sockets are local, they are never proxied
+    if (!target.socketPath.empty()) {
+        return false;
+    }
+    string url = target.proxy;
+    if (url.empty()) {
+        std::lock_guard<std::mutex> guard(proxy_lock);
+        if (bypassesProxy(target.host, proxy_config.noProxy)) {
+            return false;
+        }
+        url = target.isSsl ? proxy_config.httpsProxy : proxy_config.httpProxy;
+    }
+    if (url.empty()) {
+        return false;
+    }
+    URLView view;
+    if (!parseURL(url, view)) {
+        return true;
+    }
+    route.host = string(view.host);
+    route.port = view.port.empty() ? 80 : atoi(string(view.port).c_str());
+    if (!view.userinfo.empty()) {
+        route.authorization = "Basic " + base64Encode(percentDecode(view.userinfo));
+    }
+    return true;
+}
+
+//Returns the pool key of connections through route to target
+static string proxyRouteKey(const HTTPDispatch &target, const ProxyRoute &route) {
+    string key = route.host + ":" + std::to_string(route.port) + " " + route.authorization;
+    key += target.isSsl ? " https://" : " http://";
+    key += target.host + ":" + std::to_string(target.port);
+    if (target.isSsl && !target.verify) {
+        key += " noverify";
+    }
+    return key;
+}
+
+//Rewrites the request line of payload to the absolute-form a proxy expects and adds the proxy credentials
+static string proxyPayload(const string &payload, const HTTPDispatch &target, const ProxyRoute &route) {
+    size_t methodEnd = payload.find(' ');
+    size_t lineEnd = payload.find("\r\n");
+    if (methodEnd == string::npos || lineEnd == string::npos || methodEnd > lineEnd) {
+        return payload;
+    }
+    string result;
+    result.reserve(payload.size() + target.host.size() + route.authorization.size() + 64);
+    result.append(payload, 0, methodEnd + 1);
+    result += "http://" + hostHeader(target.host, target.port, false);
+    result.append(payload, methodEnd + 1, lineEnd + 2 - (methodEnd + 1));
+    if (!route.authorization.empty()) {
+        result += "Proxy-Authorization: " + route.authorization + "\r\n";
+    }
+    result.append(payload, lineEnd + 2, string::npos);
+    return result;
+}
+
+//Opens a connection to the proxy of route, with tunnel set it also opens a CONNECT tunnel to target
+//https targets always need the tunnel, their ssl handshake runs through it
+static bool openProxyConnection(HTTPConnection &conn, const HTTPDispatch &target, const ProxyRoute &route, bool tunnel) {
+#ifdef REQUESTS_NO_TLS
+    if (target.isSsl) {
+        return false;
+    }
+#endif
+    if (!openSocket(conn, route.host, route.port)) {
+        return false;
+    }
+    if (!tunnel) {
+        return true;
+    }
+    string authority = target.host + ":" + std::to_string(target.port);
+    string request = "CONNECT " + authority + " HTTP/1.1\r\nHost: " + authority + "\r\n";
+    if (!route.authorization.empty()) {
+        request += "Proxy-Authorization: " + route.authorization + "\r\n";
+    }
+    request += "\r\n";
+    //A successful CONNECT response has no body, the tunnel starts right after its headers
+    int status_code = 0;
+    HTTPStreamHandlers handlers;
+    handlers.on_status = [&status_code](int code) {
+        status_code = code;
+        return true;
+    };
+    if (!connectionWrite(conn, request.data(), request.size()) || !receiveResponse(conn, handlers, true, NULL) || status_code < 200 || status_code >= 300) {
+        closeConnection(conn);
+        conn.error = ERROR_CONNECT;
+        return false;
+    }
+    return !target.isSsl || startTLS(conn, target.verify, target.host);
+}
+
+//Size of the chunks a produced request body is sent in, it bounds the memory an upload holds
+#define UPLOAD_CHUNK_SIZE 65536
+
+//Sends the output of producer as a chunked body, each chunk goes out in one write together with its framing
+static bool writeChunkedBody(HTTPConnection &conn, HTTPBodyProducer &producer) {
+    //Every chunk is a complete write, waiting for more data (Nagle) would only delay it
+    int nodelay = 1;
+    setsockopt(conn.sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+    //Room for the hex size line in front of the data and the CRLF behind it
+    const size_t prefix = 18;
+    std::vector<char> buffer(prefix + UPLOAD_CHUNK_SIZE + 2);
+    while (true) {
+        long long produced = producer(buffer.data() + prefix, UPLOAD_CHUNK_SIZE);
+        if (produced < 0 || produced > UPLOAD_CHUNK_SIZE) {
+            return false;
+        }
+        if (produced == 0) {
+            return connectionWrite(conn, "0\r\n\r\n", 5);
+        }
+        char sizeLine[prefix + 1];
+        int len = snprintf(sizeLine, sizeof(sizeLine), "%llx\r\n", produced);
+        char *start = buffer.data() + prefix - len;
+        memcpy(start, sizeLine, len);
+        memcpy(buffer.data() + prefix + produced, "\r\n", 2);
+        if (!connectionWrite(conn, start, len + produced + 2)) {
+            return false;
+        }
+    }
+}
+
+//Waits up to timeoutMs for the server to accept a held back body, feeding what it sends into parser
+//finalFirst is set when the server answered with a final status instead of 100 Continue
+//Returns false if the connection failed
+static bool awaitContinue(HTTPConnection &conn, HTTPResponseParser &parser, int timeoutMs, bool &finalFirst) {
+    finalFirst = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    char buffer[MIN_READ_SIZE];
+    while (!parser.continued) {
+        if (parser.state != PARSE_STATUS && !parser.interim) {
+            finalFirst = true;
+            return true;
+        }
+        long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        //Servers that ignore Expect get the body once the timeout passes
+        if (remaining <= 0 || !waitReadable(conn, (int)remaining)) {
+            return true;
+        }
+        int read = connectionRead(conn, buffer, sizeof(buffer));
+        if (read <= 0) {
+            conn.error = ERROR_READ;
+            return false;
+        }
+        feedResponseParser(parser, buffer, read);
+    }
+    return true;
+}
+
+//Sends request on conn and receives the response into handlers, sent is set once the whole request is written
+//A held back body is only sent after the server accepted it
+static bool exchangeRequest(HTTPConnection &conn, const HTTPDispatch &target, const string &request, HTTPStreamHandlers &handlers, std::chrono::steady_clock::time_point &sent) {
+    HTTPResponseParser parser;
+    initResponseParser(parser, handlers, false);
+    setResponseLimits(parser, target.maxHeaderBytes, target.maxBodySize);
+    size_t head = request.size() - target.heldBody;
+    if (!connectionWrite(conn, request.data(), head)) {
+        return false;
+    }
+    bool finalFirst = false;
+    if (target.heldBody > 0 && !awaitContinue(conn, parser, target.continueTimeoutMs, finalFirst)) {
+        return false;
+    }
+    if (!finalFirst) {
+        if (!connectionWrite(conn, request.data() + head, request.size() - head)) {
+            return false;
+        }
+        if (target.producer != NULL && !writeChunkedBody(conn, *target.producer)) {
+            return false;
+        }
+    }
+    sent = std::chrono::steady_clock::now();
+    bool success = continueResponse(conn, parser, target.bodySink);
+    if (finalFirst) {
+        //The server may still expect the body it refused, so the connection can not carry another request
+        conn.reusable = false;
+    }
+    return success;
+}
+
+//Struct defining the state of the concurrency limiter for one host:port
+struct HostLimiter {
+    std::mutex lock;
+    std::condition_variable slotFree;
+    double limit = 0;
+    int inFlight = 0;
+    int queued = 0;
+    double baselineMs = 0;
+    std::chrono::steady_clock::time_point lastDecrease;
+    unsigned long long rejected = 0;
+};
+
+static std::mutex limiters_lock;
+//Limiters are reset in place rather than removed, so requests in flight during a reconfiguration still count
+static std::map<string, std::shared_ptr<HostLimiter>> limiters;
+static HTTPLimiterConfig limiter_config;
+
+//Will enable, reconfigure or (with enabled = false) disable the per host concurrency limiter
+//Every host starts over at the initial limit, requests in flight keep their slots
+void setConcurrencyLimiter(HTTPLimiterConfig config) {
+    std::lock_guard<std::mutex> guard(limiters_lock);
+    limiter_config = config;
+    for (auto &entry : limiters) {
+        HostLimiter &limiter = *entry.second;
+        std::lock_guard<std::mutex> limiterGuard(limiter.lock);
+        limiter.limit = config.initialLimit;
+        limiter.baselineMs = 0;
+        limiter.lastDecrease = std::chrono::steady_clock::time_point();
+        limiter.rejected = 0;
+        limiter.slotFree.notify_all();
+    }
+}
+
+//Returns the limiter for host:port, or nullptr when limiting is disabled
+static std::shared_ptr<HostLimiter> getHostLimiter(const string &host, int port, HTTPLimiterConfig &config) {
+    std::lock_guard<std::mutex> guard(limiters_lock);
+    config = limiter_config;
+    if (!config.enabled) {
+        return nullptr;
+    }
+    std::shared_ptr<HostLimiter> &limiter = limiters[host + ":" + std::to_string(port)];
+    if (!limiter) {
+        limiter = std::make_shared<HostLimiter>();
+        limiter->limit = config.initialLimit;
+    }
+    return limiter;
+}
+
+//Waits for an in-flight slot, returns false if the request is rejected
+static bool acquireLimiterSlot(HostLimiter &limiter, const HTTPLimiterConfig &config) {
+    std::unique_lock<std::mutex> guard(limiter.lock);
+    auto hasSlot = [&limiter]() { return limiter.inFlight < (int)limiter.limit; };
+    if (!hasSlot()) {
+        if (config.queueTimeoutMs <= 0 || limiter.queued >= config.maxQueued) {
+            limiter.rejected++;
+            return false;
+        }
+        limiter.queued++;
+        bool acquired = limiter.slotFree.wait_for(guard, std::chrono::milliseconds(config.queueTimeoutMs), hasSlot);
+        limiter.queued--;
+        if (!acquired) {
+            limiter.rejected++;
+            return false;
+        }
+    }
+    limiter.inFlight++;
+    return true;
+}
+
+//Releases a slot and adjusts the limit (AIMD)
+//Healthy requests grow the limit by one per window of "limit" requests, overload halves it at most once per round trip
+//A streamed response lasts as long as its caller reads it, so only its failure adjusts the limit
+static void releaseLimiterSlot(HostLimiter &limiter, const HTTPLimiterConfig &config, std::chrono::steady_clock::time_point started, bool failed, bool streamed) {
+    auto now = std::chrono::steady_clock::now();
+    double latencyMs = std::chrono::duration<double, std::milli>(now - started).count();
+    std::lock_guard<std::mutex> guard(limiter.lock);
+    limiter.inFlight--;
+    limiter.slotFree.notify_all();
+    if (streamed && !failed) {
+        return;
+    }
+    if (!failed) {
+        //The baseline follows the fastest recent responses and drifts up slowly
+        limiter.baselineMs = limiter.baselineMs == 0 ? latencyMs : std::min(latencyMs, limiter.baselineMs * 1.01);
+    }
+    double threshold = limiter.baselineMs * config.latencyTolerance;
+    if (config.latencyThresholdMs > 0) {
+        threshold = config.latencyThresholdMs;
+    }
+    bool overloaded = failed || latencyMs > threshold;
+    if (overloaded) {
+        //Requests that started before the last decrease already saw it
+        if (started > limiter.lastDecrease) {
+            limiter.limit = std::max((double)config.minLimit, limiter.limit * config.backoff);
+            limiter.lastDecrease = now;
+        }
+    } else {
+        limiter.limit = std::min((double)config.maxLimit, limiter.limit + 1.0 / limiter.limit);
+    }
+}
+
+//Will return the current limiter state of host:port
+HTTPLimiterStats getLimiterStats(std::string host, int port) {
+    HTTPLimiterStats stats = HTTPLimiterStats();
+    std::shared_ptr<HostLimiter> limiter;
+    {
+        std::lock_guard<std::mutex> guard(limiters_lock);
+        if (!limiter_config.enabled) {
+            return stats;
+        }
+        auto it = limiters.find(host + ":" + std::to_string(port));
+        if (it == limiters.end()) {
+            //A host without requests yet starts at the initial limit
+            stats.limit = limiter_config.initialLimit;
+            return stats;
+        }
+        limiter = it->second;
+    }
+    std::lock_guard<std::mutex> guard(limiter->lock);
+    stats.limit = (int)limiter->limit;
+    stats.inFlight = limiter->inFlight;
+    stats.queued = limiter->queued;
+    stats.baselineLatencyMs = limiter->baselineMs;
+    stats.rejected = limiter->rejected;
+    return stats;
+}
+
+//Struct defining one resolved address of a balanced host
+struct Backend {
+    string address;
+    int outstanding = 0;
+    unsigned long long requests = 0;
+    unsigned long long failures = 0;
+    int consecutiveFailures = 0;
+    int ejections = 0;
+    std::chrono::steady_clock::time_point ejectedUntil;
+};
+
+//Struct defining the address set of one host:port and the balancing state over it
+struct BalancedHost {
+    std::mutex lock;
+    std::vector<Backend> backends;
+    std::chrono::steady_clock::time_point resolved;
+    size_t next = 0;
+    std::mt19937 rng;
+};
+
+static std::mutex balancer_lock;
+static HTTPBalancerConfig balancer_config;
+static std::map<string, BalancedHost> balanced_hosts;
+
+//Will enable, reconfigure or (with enabled = false) disable client-side load balancing
+void setLoadBalancing(HTTPBalancerConfig config) {
+    std::lock_guard<std::mutex> guard(balancer_lock);
+    balancer_config = config;
+}
+
+//Returns the balancing state of the host of target, NULL when balancing is off or does not apply
+//Requests with a fixed ip address, a unix socket or a proxy are not balanced
+static BalancedHost *getBalancedHost(const HTTPDispatch &target, bool proxied, HTTPBalancerConfig &config) {
+    if (proxied || !target.socketPath.empty() || target.ipaddr != target.host || is_ip_address(target.host) || target.host.front() == '[') {
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(balancer_lock);
+    config = balancer_config;
+    if (!config.enabled) {
+        return NULL;
+    }
+    return &balanced_hosts[target.host + ":" + std::to_string(target.port)];
+}
+
+//Resolves the addresses of host again once the last resolution is older than refreshMs
+//Addresses that are still returned keep their counters and ejection
+static void refreshBackends(BalancedHost &balanced, const string &host, const HTTPBalancerConfig &config) {
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(balanced.lock);
+        if (!balanced.backends.empty() && now - balanced.resolved < std::chrono::milliseconds(config.refreshMs)) {
+            return;
+        }
+        //Other requests keep using the old set while this one resolves
+        balanced.resolved = now;
+    }
+    std::vector<string> addresses = resolveAllAddresses(host);
+    if (addresses.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(balanced.lock);
+    std::vector<Backend> backends;
+    for (const string &address : addresses) {
+        auto old = std::find_if(balanced.backends.begin(), balanced.backends.end(), [&address](const Backend &backend) {
+            return backend.address == address;
+        });
+        if (old != balanced.backends.end()) {
+            backends.push_back(*old);
+        } else {
+            Backend backend;
+            backend.address = address;
+            backends.push_back(backend);
+        }
+    }
+    if (balanced.backends.empty()) {
+        balanced.rng.seed(std::random_device()());
+    }
+    balanced.backends = backends;
+}
+
+//Picks the address of the next request with the configured policy and counts it as outstanding
+//Ejected addresses are skipped unless every address is ejected, exclude is never picked
+//Returns "" if the host did not resolve or exclude is its only address
+static string pickBackend(BalancedHost &balanced, const HTTPBalancerConfig &config, const string &exclude) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(balanced.lock);
+    std::vector<Backend *> candidates;
+    for (Backend &backend : balanced.backends) {
+        if (backend.ejectedUntil <= now && backend.address != exclude) {
+            candidates.push_back(&backend);
+        }
+    }
+    if (candidates.empty()) {
+        for (Backend &backend : balanced.backends) {
+            if (backend.address != exclude) {
+                candidates.push_back(&backend);
+            }
+        }
+    }
+    if (candidates.empty()) {
+        return "";
+    }
+    size_t start = balanced.next++ % candidates.size();
+    Backend *chosen = candidates[start];
+    if (config.policy == BALANCE_LEAST_OUTSTANDING) {
+        //Ties go round robin, so an idle host set is still spread evenly
+        for (size_t i = 1; i < candidates.size(); i++) {
+            Backend *backend = candidates[(start + i) % candidates.size()];
+            if (backend->outstanding < chosen->outstanding) {
+                chosen = backend;
+            }
+        }
+    } else if (config.policy == BALANCE_POWER_OF_TWO && candidates.size() > 1) {
+        std::uniform_int_distribution<size_t> pick(0, candidates.size() - 1);
+        size_t first = pick(balanced.rng);
+        size_t second = pick(balanced.rng);
+        while (second == first) {
+            second = pick(balanced.rng);
+        }
+        chosen = candidates[first];
+        if (candidates[second]->outstanding < chosen->outstanding) {
+            chosen = candidates[second];
+        }
+    }
+    chosen->outstanding++;
+    chosen->requests++;
+    return chosen->address;
+}
+
+//Ends a request to address, failed counts a connect failure towards ejecting it
+static void releaseBackend(BalancedHost &balanced, const HTTPBalancerConfig &config, const string &address, bool failed) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(balanced.lock);
+    Backend *backend = NULL;
+    int ejected = 0;
+    for (Backend &candidate : balanced.backends) {
+        if (candidate.address == address) {
+            backend = &candidate;
+        }
+        if (candidate.ejectedUntil > now) {
+            ejected++;
+        }
+    }
+    //The address may have dropped out of the set since it was picked
+    if (backend == NULL) {
+        return;
+    }
+    backend->outstanding--;
+    if (!failed) {
+        backend->consecutiveFailures = 0;
+        return;
+    }
+    backend->failures++;
+    backend->consecutiveFailures++;
+    if (backend->consecutiveFailures >= config.ejectAfterFailures && backend->ejectedUntil <= now
+        && ejected + 1 <= config.maxEjectedFraction * balanced.backends.size()) {
+        //Each ejection lasts longer than the one before, up to 10 times ejectionMs
+        backend->ejections++;
+        backend->ejectedUntil = now + std::chrono::milliseconds((long long)config.ejectionMs * std::min(backend->ejections, 10));
+        backend->consecutiveFailures = 0;
+    }
+}
+
+//Returns the addresses of host:port with their balancing counters, empty when the host was never balanced
+std::vector<HTTPBackendStats> getBalancerStats(string host, int port) {
+    std::vector<HTTPBackendStats> stats;
+    BalancedHost *balanced;
+    {
+        std::lock_guard<std::mutex> guard(balancer_lock);
+        auto it = balanced_hosts.find(host + ":" + std::to_string(port));
+        if (it == balanced_hosts.end()) {
+            return stats;
+        }
+        balanced = &it->second;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(balanced->lock);
+    for (const Backend &backend : balanced->backends) {
+        HTTPBackendStats entry;
+        entry.address = backend.address;
+        entry.outstanding = backend.outstanding;
+        entry.requests = backend.requests;
+        entry.failures = backend.failures;
+        entry.ejected = backend.ejectedUntil > now;
+        stats.push_back(entry);
+    }
+    return stats;
+}
+
+//Returns the pool key of the unix socket of target
+static string unixRouteKey(const HTTPDispatch &target) {
+    return string(target.isSsl ? "https+unix:" : "http+unix:") + target.socketPath;
+}
+
+//Returns the pool key of a direct connection to target
+static string directRouteKey(const HTTPDispatch &target) {
+    string key = target.isSsl ? "https://" : "http://";
+    key += target.host + ":" + std::to_string(target.port);
+    if (target.ipaddr != target.host) {
+        key += " " + target.ipaddr;
+    }
+    if (target.isSsl && !target.verify) {
+        key += " noverify";
+    }
+    return key;
+}
+
+//Returns the pool key of the connections target is sent over
+static string dispatchRouteKey(const HTTPDispatch &target, const ProxyRoute &route, bool proxied) {
+    if (!target.socketPath.empty()) {
+        return unixRouteKey(target);
+    }
+    return proxied ? proxyRouteKey(target, route) : directRouteKey(target);
+}
+
+//Opens a connection to the unix socket of target, with the ssl handshake for https+unix
+static bool openUnixConnection(HTTPConnection &conn, const HTTPDispatch &target) {
+    if (!openUnixSocket(conn, target.socketPath)) {
+        return false;
+    }
+    return !target.isSsl || startTLS(conn, target.verify, target.host);
+}
+
+//Opens a new connection for target, over its unix socket, through its proxy or directly
+static bool openDispatchConnection(HTTPConnection &conn, const HTTPDispatch &target, const ProxyRoute &route, bool proxied) {
+    if (!target.socketPath.empty()) {
+        return openUnixConnection(conn, target);
+    }
+    if (proxied) {
+        return openProxyConnection(conn, target, route, target.isSsl);
+    }
+    return openConnection(conn, target.ipaddr, target.port, target.isSsl, target.verify, target.host);
+}
+
+//Returns the host and port the metrics of target are counted under, unix sockets use their path and port 0
+static string metricsHost(const HTTPDispatch &target) {
+    return target.socketPath.empty() ? target.host : "unix:" + target.socketPath;
+}
+
+static int metricsPort(const HTTPDispatch &target) {
+    return target.socketPath.empty() ? target.port : 0;
+}
+
+//Returns whether the request in payload can be sent again without side effects, as defined by RFC 9110
+static bool idempotentRequest(const string &payload) {
+    static const char *methods[] = { "GET ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", "TRACE " };
+    for (const char *method : methods) {
+        if (payload.compare(0, strlen(method), method) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Sends payload to the target and streams the response into handlers
+static bool dispatchStream(HTTPDispatch &target, const string &payload, HTTPStreamHandlers &handlers) {
+    HTTPConnection conn;
+    bool success = false;
+    HTTPLimiterConfig config;
+    std::shared_ptr<HostLimiter> limiter = getHostLimiter(target.host, target.port, config);
+    if (limiter && !acquireLimiterSlot(*limiter, config)) {
+        recordRejectedRequest(target.host, target.port);
+        if (handlers.on_complete) {
+            handlers.on_complete(false);
+        }
+        return false;
+    }
+    auto started = std::chrono::steady_clock::now();
+    //Overload statuses count against the limiter like connection failures
+    int status_code = 0;
+    HTTPStreamHandlers observed = handlers;
+    observed.on_status = [&handlers, &status_code](int code) {
+        status_code = code;
+        return !handlers.on_status || handlers.on_status(code);
+    };
+    //Connections are pooled per route, plain http to a proxy goes out in absolute-form
+    ProxyRoute route;
+    bool proxied = proxyRoute(target, route);
+    string routeKey = dispatchRouteKey(target, route, proxied);
+    string absolute;
+    const string *request = &payload;
+    if (proxied && !target.isSsl) {
+        absolute = proxyPayload(payload, target, route);
+        request = &absolute;
+    }
+    //With load balancing on, the request goes to one of the addresses of the host and uses that address's pool
+    HTTPBalancerConfig balancing;
+    BalancedHost *balanced = getBalancedHost(target, proxied, balancing);
+    if (balanced != NULL) {
+        refreshBackends(*balanced, target.host, balancing);
+        string address = pickBackend(*balanced, balancing, "");
+        if (address.empty()) {
+            balanced = NULL;
+        } else {
+            target.ipaddr = address;
+            routeKey = dispatchRouteKey(target, route, proxied);
+        }
+    }
+    bool connected = takePooledConnection(routeKey, conn) || openDispatchConnection(conn, target, route, proxied);
+    if (!connected && balanced != NULL && conn.error == ERROR_CONNECT) {
+        //A refused or unreachable address counts towards its ejection and the request moves to another one
+        releaseBackend(*balanced, balancing, target.ipaddr, true);
+        string address = pickBackend(*balanced, balancing, target.ipaddr);
+        if (address.empty()) {
+            //The host has no other address, the failure was already counted
+            balanced = NULL;
+        } else {
+            target.ipaddr = address;
+            routeKey = dispatchRouteKey(target, route, proxied);
+            conn = HTTPConnection();
+            connected = takePooledConnection(routeKey, conn) || openDispatchConnection(conn, target, route, proxied);
+        }
+    }
+    bool idempotent = idempotentRequest(payload);
+    std::chrono::steady_clock::time_point sent;
+    while (connected) {
+        target.ktlsActive = conn.ktls;
+        conn.sendStart = std::chrono::steady_clock::now();
+        if (registerCancel(target.cancel, conn.sock)) {
+            success = exchangeRequest(conn, target, *request, observed, sent);
+        }
+        bool cancelled = !registerCancel(target.cancel, INVALID_SOCKET);
+        //A pooled connection the peer closed while it was idle fails before any response byte
+        //A produced body can not be replayed, so those requests are not retried
+        //Other methods are only replayed when the write failed, as the server may have acted on a request it read in full
+        //A cancelled dispatch stops here rather than opening a new connection
+        bool stale = conn.reused && !success && conn.bytesReceived == 0 && target.producer == NULL && !cancelled
+            && (idempotent || conn.error == ERROR_WRITE);
+        releasePooledConnection(routeKey, conn);
+        if (!stale) {
+            break;
+        }
+        conn = HTTPConnection();
+        connected = openDispatchConnection(conn, target, route, proxied);
+    }
+    if (conn.error == ERROR_LIMIT && target.bodySink != NULL) {
+        //A buffered response over its limits is reported as status 0, its partial body is freed at once
+        string().swap(*target.bodySink);
+        if (handlers.on_status) {
+            handlers.on_status(0);
+        }
+    }
+    if (balanced != NULL) {
+        releaseBackend(*balanced, balancing, target.ipaddr, conn.error == ERROR_CONNECT);
+    }
+    recordConnectionMetrics(metricsHost(target), metricsPort(target), conn, started, sent);
+    if (limiter) {
+        bool overloaded = status_code == 429 || status_code == 503 || status_code == 504;
+        releaseLimiterSlot(*limiter, config, started, (!success && status_code == 0) || overloaded, target.streamed);
+    }
+    if (handlers.on_complete) {
+        handlers.on_complete(success);
+    }
+    return success;
+}
+
+//How often the routes kept warm by setMinIdleConnections are topped up
+#define WARM_REFRESH_MS 1000
+
+//Struct defining a route whose pool is kept at a minimum of idle connections
+struct WarmRoute {
+    HTTPDispatch target;
+    int minIdle = 0;
+};
+
+static std::mutex warm_lock;
+static std::condition_variable warm_changed;
+static std::map<string, WarmRoute> warm_routes;
+static std::thread *warm_thread = NULL;
+static bool warm_stopping = false;
+
+//Opens connections for target in parallel until n idle ones are parked in the pool of routeKey, returns how many were opened
+//Up to POOL_FILL_THREADS connections are opened at the same time
+static int fillRoutePool(HTTPDispatch target, const ProxyRoute &route, bool proxied, const string &routeKey, int n) {
+    raisePoolCapacity(routeKey, n);
+    int missing = n - (int)countIdleConnections(routeKey);
+    if (missing <= 0) {
+        return 0;
+    }
+    //The name is resolved once for all of them, the pool key keeps the unresolved host requests look up
+    if (!proxied && target.socketPath.empty() && !is_ip_address(target.ipaddr) && target.ipaddr.front() != '[') {
+        target.ipaddr = resolvdnsname(target.ipaddr);
+        if (target.ipaddr.empty()) {
+            return 0;
+        }
+    }
+    std::atomic<int> opened(0);
+    std::atomic<int> next(0);
+    auto opener = [&]() {
+        while (next++ < missing) {
+            HTTPConnection conn;
+            if (!openDispatchConnection(conn, target, route, proxied)) {
+                continue;
+            }
+            recordConnectionSetup(getHostMetrics(metricsHost(target), metricsPort(target)), conn);
+            opened++;
+            conn.reusable = true;
+            releasePooledConnection(routeKey, conn);
+        }
+    };
+    std::vector<std::thread> openers;
+    for (int i = 1; i < std::min(missing, POOL_FILL_THREADS); i++) {
+        openers.emplace_back(opener);
+    }
+    opener();
+    for (std::thread &thread : openers) {
+        thread.join();
+    }
+    return opened.load();
+}
+
+//Opens connections for target in parallel until n idle ones are parked in its pool, returns how many were opened
+//A balanced host has a pool per address, the n connections are spread over the addresses requests are sent to
+static int fillConnectionPool(HTTPDispatch target, int n) {
+    ProxyRoute route;
+    bool proxied = proxyRoute(target, route);
+    HTTPBalancerConfig balancing;
+    BalancedHost *balanced = getBalancedHost(target, proxied, balancing);
+    if (balanced == NULL) {
+        return fillRoutePool(target, route, proxied, dispatchRouteKey(target, route, proxied), n);
+    }
+    refreshBackends(*balanced, target.host, balancing);
+    std::vector<string> addresses;
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> guard(balanced->lock);
+        for (const Backend &backend : balanced->backends) {
+            if (backend.ejectedUntil <= now) {
+                addresses.push_back(backend.address);
+            }
+        }
+        //Requests use every address again once all of them are ejected, so all of them are warmed
+        if (addresses.empty()) {
+            for (const Backend &backend : balanced->backends) {
+                addresses.push_back(backend.address);
+            }
+        }
+    }
+    int opened = 0;
+    for (const string &address : addresses) {
+        target.ipaddr = address;
+        opened += fillRoutePool(target, route, proxied, dispatchRouteKey(target, route, proxied), (n + (int)addresses.size() - 1) / (int)addresses.size());
+    }
+    return opened;
+}
+
+//Will open connections to the host of url in parallel, with their TLS handshakes, until n idle ones wait in the pool
+int preconnect(string url, int n) {
+    HTTPGetRequest request = CreateGetRequest(url);
+    if (request.host.empty() || n <= 0) {
+        return 0;
+    }
+    return fillConnectionPool(dispatchTarget(request), n);
+}
+
+//Tops up the pools of the warm routes until setMinIdleConnections has nothing left to keep warm or the process exits
+static void warmConnectionsLoop() {
+    std::unique_lock<std::mutex> guard(warm_lock);
+    while (!warm_stopping) {
+        std::vector<WarmRoute> routes;
+        for (auto &entry : warm_routes) {
+            routes.push_back(entry.second);
+        }
+        guard.unlock();
+        for (WarmRoute &route : routes) {
+            fillConnectionPool(route.target, route.minIdle);
+        }
+        guard.lock();
+        warm_changed.wait_for(guard, std::chrono::milliseconds(WARM_REFRESH_MS));
+    }
+}
+
+//Stops the warm up thread before the pool it fills is destroyed at exit
+static void stopWarmConnections() {
+    {
+        std::lock_guard<std::mutex> guard(warm_lock);
+        warm_stopping = true;
+    }
+    warm_changed.notify_all();
+    warm_thread->join();
+}
+
+//Will keep at least minIdle idle connections to the host of url in the pool, replacing those that expire or are closed
+//A minIdle of 0 stops keeping the host warm
+void setMinIdleConnections(string url, int minIdle) {
+    HTTPGetRequest request = CreateGetRequest(url);
+    if (request.host.empty()) {
+        return;
+    }
+    HTTPDispatch target = dispatchTarget(request);
+    ProxyRoute route;
+    string routeKey = dispatchRouteKey(target, route, proxyRoute(target, route));
+    std::lock_guard<std::mutex> guard(warm_lock);
+    if (minIdle <= 0) {
+        warm_routes.erase(routeKey);
+        return;
+    }
+    warm_routes[routeKey] = { target, minIdle };
+    if (warm_thread == NULL) {
+        warm_thread = new std::thread(warmConnectionsLoop);
+        atexit(stopWarmConnections);
+    }
+    warm_changed.notify_all();
+}
+
+//Handlers that buffer a whole response into a HTTPResponse
+static HTTPStreamHandlers collectResponse(HTTPResponse &response) {
+    response.status_code = 0;
+    response.ktls_active = false;
+    HTTPStreamHandlers handlers;
+    handlers.on_status = [&response](int status_code) {
+        response.status_code = status_code;
+        return true;
+    };
+    //Content-Length bodies are sized by readBodyInto once the limits and the memory budget allow it
+    handlers.on_header = [&response](const string &key, const string &value) {
+        response.headers[key] = value;
+        return true;
+    };
+    handlers.on_body_chunk = [&response](std::string_view chunk) {
+        response.body.append(chunk.data(), chunk.size());
+        return true;
+    };
+    return handlers;
+}
+
+//Will decode a HTTP response string to a HTTPResponse struct
+HTTPResponse decodePacket(string packet) {
+    HTTPResponse response;
+    HTTPStreamHandlers handlers = collectResponse(response);
+    HTTPResponseParser parser;
+    initResponseParser(parser, handlers, false);
+    feedResponseParser(parser, packet.data(), packet.size());
+    return response;
+}
+
+//Number of recent GET latencies kept per host:port for the hedging delay
+#define HEDGE_SAMPLES 256
+//How long the resolved addresses of a host are reused to pick the hedge's address
+#define HEDGE_ADDRESSES_MS 30000
+
+//Struct defining the recent GET latencies to one host:port and the addresses it resolved to
+struct HedgeHost {
+    double samples[HEDGE_SAMPLES];
+    int count = 0;
+    int next = 0;
+    std::vector<string> addresses;
+    std::chrono::steady_clock::time_point resolved;
+};
+
+static std::mutex hedging_lock;
+static HTTPHedgingConfig hedging_config;
+static HTTPHedgingStats hedging_stats;
+static double hedging_tokens = 0;
+static std::map<string, HedgeHost> hedge_hosts;
+
+//Will enable, reconfigure or (with enabled = false) disable hedging of HTTPGet requests
+void setHedgingPolicy(HTTPHedgingConfig config) {
+    std::lock_guard<std::mutex> guard(hedging_lock);
+    hedging_config = config;
+    hedging_stats = HTTPHedgingStats();
+    hedging_tokens = 0;
+    hedge_hosts.clear();
+}
+
+//Will return the hedging counters since the policy was last set
+HTTPHedgingStats getHedgingStats() {
+    std::lock_guard<std::mutex> guard(hedging_lock);
+    return hedging_stats;
+}
+
+//Returns the delay before a hedge is sent to key, from the configured latency percentile
+static double hedgeDelayMs(const string &key, const HTTPHedgingConfig &config) {
+    HedgeHost &host = hedge_hosts[key];
+    if (host.count < config.minSamples) {
+        return std::max((double)config.minDelayMs, (double)config.initialDelayMs);
+    }
+    std::vector<double> sorted(host.samples, host.samples + host.count);
+    size_t rank = (size_t)(config.percentile / 100.0 * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return std::max((double)config.minDelayMs, sorted[rank]);
+}
+
+//Records the latency of a successful GET to key
+static void recordHedgeLatency(const string &key, double latencyMs) {
+    std::lock_guard<std::mutex> guard(hedging_lock);
+    HedgeHost &host = hedge_hosts[key];
+    host.samples[host.next] = latencyMs;
+    host.next = (host.next + 1) % HEDGE_SAMPLES;
+    host.count = std::min(host.count + 1, HEDGE_SAMPLES);
+}
+
+//Struct defining one attempt of a hedged GET
+struct HedgeAttempt {
+    HTTPResponse response;
+    HTTPCancel cancel;
+    bool finished = false;
+    bool success = false;
+};
+
+//Struct defining the state shared between a hedged GET and its attempts
+struct HedgeState {
+    std::mutex lock;
+    std::condition_variable changed;
+    HedgeAttempt attempts[2];
+    int winner = -1;
+};
+
+//Starts attempt index of a hedged GET on its own thread, the hedged GET joins it before returning
+static std::thread startHedgeAttempt(HedgeState &state, int index, HTTPDispatch target, const string &payload, const string &key) {
+    return std::thread([&state, index, target, &payload, &key]() mutable {
+        HedgeAttempt &attempt = state.attempts[index];
+        HTTPResponse response;
+        HTTPStreamHandlers handlers = collectResponse(response);
+        target.cancel = &attempt.cancel;
+        target.bodySink = &response.body;
+        auto started = std::chrono::steady_clock::now();
+        bool success = dispatchStream(target, payload, handlers);
+        if (success) {
+            recordHedgeLatency(key, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+        }
+        response.ktls_active = target.ktlsActive;
+        std::lock_guard<std::mutex> guard(state.lock);
+        attempt.response = std::move(response);
+        attempt.finished = true;
+        attempt.success = success;
+        if (success && state.winner < 0) {
+            state.winner = index;
+        }
+        state.changed.notify_all();
+    });
+}
+
+//Sends a GET and, if it has not completed within the hedging delay, a duplicate to another address
+//The first successful response wins and the other attempt is cancelled
+static HTTPResponse hedgedGet(HTTPGetRequest &request, const HTTPHedgingConfig &config) {
+    HTTPDispatch target = dispatchTarget(request);
+    string key = target.host + ":" + std::to_string(target.port);
+    double delayMs;
+    std::vector<string> addresses;
+    bool resolve = false;
+    {
+        std::lock_guard<std::mutex> guard(hedging_lock);
+        hedging_stats.requests++;
+        //Every GET earns a fraction of a hedge, capped so bursts can not spend a large backlog
+        hedging_tokens = std::min(hedging_tokens + config.budget, std::max(1.0, config.budget * 100));
+        delayMs = hedgeDelayMs(key, config);
+        HedgeHost &host = hedge_hosts[key];
+        addresses = host.addresses;
+        auto now = std::chrono::steady_clock::now();
+        if (request.ipaddr.empty() && (addresses.empty() || now - host.resolved >= std::chrono::milliseconds(HEDGE_ADDRESSES_MS))) {
+            //Other GETs keep using the old addresses while this one resolves
+            host.resolved = now;
+            resolve = true;
+        }
+    }
+    HedgeState state;
+    string payload = encode_payload(request);
+    //Without known addresses the first attempt resolves the host like any other request
+    if (request.ipaddr.empty() && !addresses.empty()) {
+        target.ipaddr = addresses[0];
+    }
+    std::thread attempts[2];
+    attempts[0] = startHedgeAttempt(state, 0, target, payload, key);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(delayMs));
+    if (resolve) {
+        //The lookup overlaps the first attempt instead of delaying it
+        std::vector<string> resolved = resolveAllAddresses(request.host);
+        if (!resolved.empty()) {
+            std::lock_guard<std::mutex> guard(hedging_lock);
+            hedge_hosts[key].addresses = resolved;
+            if (addresses.empty()) {
+                addresses = resolved;
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(state.lock);
+    bool primaryDone = state.changed.wait_until(guard, deadline, [&state]() { return state.attempts[0].finished; });
+    bool hedged = false;
+    if (!primaryDone) {
+        std::lock_guard<std::mutex> budgetGuard(hedging_lock);
+        if (hedging_tokens >= 1) {
+            hedging_tokens -= 1;
+            hedging_stats.hedged++;
+            hedged = true;
+        } else {
+            hedging_stats.budgetExhausted++;
+        }
+    }
+    if (hedged) {
+        //Prefer a different backend than the slow one
+        if (request.ipaddr.empty() && !addresses.empty()) {
+            target.ipaddr = addresses[1 % addresses.size()];
+        }
+        attempts[1] = startHedgeAttempt(state, 1, target, payload, key);
+        state.changed.wait(guard, [&state]() {
+            return state.winner >= 0 || (state.attempts[0].finished && state.attempts[1].finished);
+        });
+    } else {
+        state.changed.wait(guard, [&state]() { return state.attempts[0].finished; });
+    }
+    int winner = state.winner >= 0 ? state.winner : 0;
+    if (hedged) {
+        cancelDispatch(state.attempts[1 - winner].cancel);
+        if (winner == 1) {
+            std::lock_guard<std::mutex> statsGuard(hedging_lock);
+            hedging_stats.hedgeWins++;
+        }
+    }
+    HTTPResponse response = std::move(state.attempts[winner].response);
+    guard.unlock();
+    //The cancelled attempt returns once its socket is shut down, no attempt outlives the GET
+    for (std::thread &attempt : attempts) {
+        if (attempt.joinable()) {
+            attempt.join();
+        }
+    }
+    return response;
+}
+
+//Sends a GET, hedged when the hedging policy is enabled
+static HTTPResponse performGet(HTTPGetRequest &request) {
+    HTTPHedgingConfig hedging;
+    {
+        std::lock_guard<std::mutex> guard(hedging_lock);
+        hedging = hedging_config;
+    }
+    if (hedging.enabled) {
+        return hedgedGet(request, hedging);
+    }
+    HTTPResponse response;
+    HTTPStreamHandlers handlers = collectResponse(response);
+    HTTPDispatch target = dispatchTarget(request);
+    target.bodySink = &response.body;
+    dispatchStream(target, encode_payload(request), handlers);
+    response.ktls_active = target.ktlsActive;
+    return response;
+}
+
+//Struct defining a GET that identical requests can wait on
+struct InFlightGet {
+    std::mutex lock;
+    std::condition_variable done;
+    bool finished = false;
+    std::shared_ptr<HTTPResponse> response;
+    //Callers that have not taken the response yet, and whether one took it through HTTPGetShared
+    int collectors = 1;
+    bool shared = false;
+};
+
+static std::mutex coalescing_lock;
+static HTTPCoalescingConfig coalescing_config;
+static std::map<string, std::shared_ptr<InFlightGet>> inflight_gets;
+
+//Will enable, reconfigure or (with enabled = false) disable coalescing of identical in-flight GETs
+void setRequestCoalescing(HTTPCoalescingConfig config) {
+    std::lock_guard<std::mutex> guard(coalescing_lock);
+    coalescing_config = config;
+}
+
+//Returns the key identical GETs share a response under
+//Everything that can change what the response is or how it was fetched is part of it
+static string coalescingKey(const HTTPGetRequest &request, const HTTPCoalescingConfig &config) {
+    string key = "GET " + request.url;
+    key += "\nverify: " + string(request.sslVerify ? "1" : "0");
+    key += "\nproxy: " + request.proxy;
+    key += "\nipaddr: " + request.ipaddr;
+    key += "\nsocket: " + request.socketPath;
+    key += "\nlimits: " + std::to_string(request.maxHeaderBytes) + " " + std::to_string(request.maxBodySize);
+    for (const string &name : config.keyHeaders) {
+        for (auto &header : request.headers) {
+            if (equalsIgnoreCase(header.first, name.c_str())) {
+                key += "\n" + name + ": " + header.second;
+            }
+        }
+    }
+    return key;
+}
+
+//Hands the leader's response to the GETs waiting on flight when it goes out of scope
+//If the request threw, the waiters get an empty response with status_code 0 instead of waiting forever
+struct CoalescedPublisher {
+    string key;
+    std::shared_ptr<InFlightGet> flight;
+    std::shared_ptr<HTTPResponse> response;
+
+    ~CoalescedPublisher() {
+        {
+            //Later callers start a new request, they must not see a response older than their call
+            std::lock_guard<std::mutex> guard(coalescing_lock);
+            inflight_gets.erase(key);
+        }
+        if (!response) {
+            response = std::make_shared<HTTPResponse>();
+        }
+        std::lock_guard<std::mutex> guard(flight->lock);
+        flight->response = response;
+        flight->finished = true;
+        flight->done.notify_all();
+    }
+};
+
+//Joins the GET identical to request that is in flight, or sends request for later identical GETs to join
+//Returns once the response is published, the caller is counted among the collectors of the flight
+static std::shared_ptr<InFlightGet> joinCoalescedGet(HTTPGetRequest &request, const HTTPCoalescingConfig &config) {
+    string key = coalescingKey(request, config);
+    std::shared_ptr<InFlightGet> flight;
+    bool leader = false;
+    {
+        std::lock_guard<std::mutex> guard(coalescing_lock);
+        std::shared_ptr<InFlightGet> &slot = inflight_gets[key];
+        if (!slot) {
+            slot = std::make_shared<InFlightGet>();
+            leader = true;
+        } else {
+            std::lock_guard<std::mutex> flightGuard(slot->lock);
+            slot->collectors++;
+        }
+        flight = slot;
+    }
+    if (leader) {
+        CoalescedPublisher publisher;
+        publisher.key = key;
+        publisher.flight = flight;
+        publisher.response = std::make_shared<HTTPResponse>(performGet(request));
+    }
+    std::unique_lock<std::mutex> guard(flight->lock);
+    flight->done.wait(guard, [&flight]() { return flight->finished; });
+    return flight;
+}
+
+//Will dispatch a HTTPGetRequest and return its response as a shared read-only object
+//With coalescing enabled identical concurrent GETs share one request and one response
+std::shared_ptr<const HTTPResponse> HTTPGetShared(HTTPGetRequest request) {
+    HTTPCoalescingConfig config;
+    {
+        std::lock_guard<std::mutex> guard(coalescing_lock);
+        config = coalescing_config;
+    }
+    if (!config.enabled) {
+        return std::make_shared<const HTTPResponse>(performGet(request));
+    }
+    std::shared_ptr<InFlightGet> flight = joinCoalescedGet(request, config);
+    std::lock_guard<std::mutex> guard(flight->lock);
+    flight->shared = true;
+    flight->collectors--;
+    return flight->response;
+}
+
+//Will dispatch a HTTPGetRequest to the server and return a HTTPResponse
+//A coalesced response is copied for each caller but the last, which moves it out unless HTTPGetShared holds it
+HTTPResponse HTTPGet(HTTPGetRequest request) {
+    HTTPCoalescingConfig config;
+    {
+        std::lock_guard<std::mutex> guard(coalescing_lock);
+        config = coalescing_config;
+    }
+    if (!config.enabled) {
+        return performGet(request);
+    }
+    std::shared_ptr<InFlightGet> flight = joinCoalescedGet(request, config);
+    {
+        std::lock_guard<std::mutex> guard(flight->lock);
+        if (flight->collectors == 1 && !flight->shared) {
+            flight->collectors = 0;
+            return std::move(*flight->response);
+        }
+    }
+    //Other callers still copying keep the response intact until they count themselves out
+    HTTPResponse response = *flight->response;
+    std::lock_guard<std::mutex> guard(flight->lock);
+    flight->collectors--;
+    return response;
+}
+
+//Compression contexts are kept per thread, so a small body does not pay for setting one up
+#ifndef REQUESTS_NO_ZLIB
+struct GzipContext {
+    z_stream stream;
+    bool ready = false;
+    int level = 0;
+
+    ~GzipContext() {
+        if (ready) {
+            deflateEnd(&stream);
+        }
+    }
+};
+static thread_local GzipContext gzip_context;
+
+//Compresses data into out as a gzip member
+static bool gzipCompress(std::string_view data, int level, string &out) {
+    GzipContext &context = gzip_context;
+    if (context.ready && context.level != level) {
+        deflateEnd(&context.stream);
+        context.ready = false;
+    }
+    if (!context.ready) {
+        memset(&context.stream, 0, sizeof(context.stream));
+        //15 + 16 selects a 32 KB window with a gzip header and trailer
+        if (deflateInit2(&context.stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        context.ready = true;
+        context.level = level;
+    } else {
+        deflateReset(&context.stream);
+    }
+    out.resize(deflateBound(&context.stream, (uLong)data.size()));
+    context.stream.next_in = (Bytef *)data.data();
+    context.stream.avail_in = (uInt)data.size();
+    context.stream.next_out = (Bytef *)&out[0];
+    context.stream.avail_out = (uInt)out.size();
+    if (deflate(&context.stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    out.resize(context.stream.total_out);
+    return true;
+}
+#endif
+
+#ifdef REQUESTS_ZSTD
+struct ZstdContext {
+    ZSTD_CCtx *cctx = NULL;
+
+    ~ZstdContext() {
+        if (cctx != NULL) {
+            ZSTD_freeCCtx(cctx);
+        }
+    }
+};
+static thread_local ZstdContext zstd_context;
+
+//Compresses data into out as a zstd frame, with dictionary when one is loaded
+static bool zstdCompress(std::string_view data, int level, const ZSTD_CDict *dictionary, string &out) {
+    if (zstd_context.cctx == NULL) {
+        zstd_context.cctx = ZSTD_createCCtx();
+        if (zstd_context.cctx == NULL) {
+            return false;
+        }
+    }
+    out.resize(ZSTD_compressBound(data.size()));
+    size_t size;
+    if (dictionary != NULL) {
+        size = ZSTD_compress_usingCDict(zstd_context.cctx, &out[0], out.size(), data.data(), data.size(), dictionary);
+    } else {
+        size = ZSTD_compressCCtx(zstd_context.cctx, &out[0], out.size(), data.data(), data.size(), level);
+    }
+    if (ZSTD_isError(size)) {
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+#endif
+
+static std::mutex compression_lock;
+static HTTPCompressionConfig compression_config;
+#ifdef REQUESTS_ZSTD
+//The digested dictionary is shared read-only by every thread, requests hold a reference while they use it
+static std::shared_ptr<ZSTD_CDict> zstd_dictionary;
+#endif
+
+//Will compress the bodies of POSTs from now on, returns false if the encoding is not built in or the dictionary is unusable
+bool setRequestCompression(HTTPCompressionConfig config) {
+#ifdef REQUESTS_ZSTD
+    std::shared_ptr<ZSTD_CDict> dictionary;
+    if (config.encoding == ENCODING_ZSTD && !config.zstdDictionary.empty()) {
+        //Digesting a dictionary is expensive, it is done once here instead of per request
+        ZSTD_CDict *digested = ZSTD_createCDict(config.zstdDictionary.data(), config.zstdDictionary.size(), config.level);
+        if (digested == NULL) {
+            return false;
+        }
+        dictionary.reset(digested, ZSTD_freeCDict);
+    }
+#else
+    if (config.encoding == ENCODING_ZSTD) {
+        return false;
+    }
+#endif
+#ifdef REQUESTS_NO_ZLIB
+    if (config.encoding == ENCODING_GZIP) {
+        return false;
+    }
+#endif
+    config.zstdDictionary.clear();
+    std::lock_guard<std::mutex> guard(compression_lock);
+    compression_config = config;
+#ifdef REQUESTS_ZSTD
+    zstd_dictionary = dictionary;
+#endif
+    return true;
+}
+
+//Compresses request.body with the configured Content-Encoding
+//Bodies below minSize, bodies that already have a Content-Encoding and bodies that would grow are left alone
+static void compressRequestBody(HTTPPostRequest &request) {
+    HTTPCompressionConfig config;
+#ifdef REQUESTS_ZSTD
+    std::shared_ptr<ZSTD_CDict> dictionary;
+#endif
+    {
+        std::lock_guard<std::mutex> guard(compression_lock);
+        config = compression_config;
+#ifdef REQUESTS_ZSTD
+        dictionary = zstd_dictionary;
+#endif
+    }
+    if (config.encoding == ENCODING_IDENTITY || request.body.empty() || request.body.size() < config.minSize) {
+        return;
+    }
+    for (auto &header : request.headers) {
+        if (equalsIgnoreCase(header.first, "Content-Encoding")) {
+            return;
+        }
+    }
+    string compressed;
+    bool done = false;
+    const char *name = "";
+#ifndef REQUESTS_NO_ZLIB
+    if (config.encoding == ENCODING_GZIP) {
+        done = gzipCompress(request.body, config.level == 0 ? Z_DEFAULT_COMPRESSION : config.level, compressed);
+        name = "gzip";
+    }
+#endif
+#ifdef REQUESTS_ZSTD
+    if (config.encoding == ENCODING_ZSTD) {
+        done = zstdCompress(request.body, config.level, dictionary.get(), compressed);
+        name = "zstd";
+    }
+#endif
+    if (!done || compressed.size() >= request.body.size()) {
+        return;
+    }
+    request.body.swap(compressed);
+    addHeader(request, "Content-Encoding", name);
+}
+
+static std::mutex expect_lock;
+static HTTPExpectContinueConfig expect_config;
+
+//Will set when POST bodies wait for the server to answer Expect: 100-continue
+void setExpectContinue(HTTPExpectContinueConfig config) {
+    std::lock_guard<std::mutex> guard(expect_lock);
+    expect_config = config;
+}
+
+//Encodes a POST for dispatch, the body is compressed first when request compression is enabled
+//A body at or above the Expect threshold is held back until the server accepts it
+//An Expect header set by the caller decides on its own
+static string encodePostPayload(HTTPPostRequest &request, HTTPDispatch &target) {
+    compressRequestBody(request);
+    HTTPExpectContinueConfig config;
+    {
+        std::lock_guard<std::mutex> guard(expect_lock);
+        config = expect_config;
+    }
+    bool expect = config.threshold > 0 && request.body.size() >= config.threshold;
+    bool explicitExpect = false;
+    for (auto &header : request.headers) {
+        if (equalsIgnoreCase(header.first, "Expect")) {
+            expect = equalsIgnoreCase(header.second, "100-continue");
+            explicitExpect = true;
+        }
+    }
+    if (expect && !request.body.empty()) {
+        if (!explicitExpect) {
+            addHeader(request, "Expect", "100-continue");
+        }
+        target.heldBody = request.body.size();
+        target.continueTimeoutMs = config.timeoutMs;
+    }
+    return encode_payload(request);
+}
+
+//Will dispatch a HTTPPostRequest to its server and return a HTTPResponse
+HTTPResponse HTTPPost(HTTPPostRequest request) {
+    HTTPResponse response;
+    HTTPStreamHandlers handlers = collectResponse(response);
+    HTTPDispatch target = dispatchTarget(request);
+    target.bodySink = &response.body;
+    string payload = encodePostPayload(request, target);
+    dispatchStream(target, payload, handlers);
+    response.ktls_active = target.ktlsActive;
+    return response;
+}
+
+//Sends keep their payload buffer for the next send on the same thread unless it grew past this
+#define PREPARED_BUFFER_KEEP (1024 * 1024)
+
+//Struct defining a request whose fixed parts were encoded once by CreatePreparedRequest
+//A send writes head + path suffix + tail + dynamic headers + Content-Length + body
+struct HTTPPreparedRequest {
+    HTTPDispatch target;
+    //Method and path prefix of the request line
+    string head;
+    //Rest of the request line, Host and the static headers
+    string tail;
+    bool sendsBody = false;
+};
+
+//Encodes the fixed parts of request once, Content-Length is written by each send
+template <typename Request>
+static std::shared_ptr<const HTTPPreparedRequest> prepareRequest(const Request &request, const char *method, bool sendsBody) {
+    if (request.host.empty()) {
+        return nullptr;
+    }
+    std::shared_ptr<HTTPPreparedRequest> prepared = std::make_shared<HTTPPreparedRequest>();
+    prepared->target = dispatchTarget(request);
+    prepared->head = string(method) + " " + request.path;
+    prepared->tail = " HTTP/1.1\r\nHost: " + hostHeader(request.host, request.port, request.isSsl) + "\r\n";
+    for (auto &header : request.headers) {
+        if (equalsIgnoreCase(header.first, "Content-Length") || equalsIgnoreCase(header.first, "Transfer-Encoding")) {
+            continue;
+        }
+        prepared->tail += header.first + ": " + header.second + "\r\n";
+    }
+    prepared->sendsBody = sendsBody;
+    return prepared;
+}
+
+//Will encode the request line prefix, Host and headers of a GET once for many sends
+std::shared_ptr<const HTTPPreparedRequest> CreatePreparedRequest(HTTPGetRequest request) {
+    return prepareRequest(request, "GET", false);
+}
+
+//Will encode the request line prefix, Host and headers of a POST once for many sends, request.body is ignored
+std::shared_ptr<const HTTPPreparedRequest> CreatePreparedRequest(HTTPPostRequest request) {
+    return prepareRequest(request, "POST", true);
+}
+
+//Appends the payload of one send of prepared to out, the fixed parts are copied as they are
+static void encodePrepared(const HTTPPreparedRequest &prepared, std::string_view pathSuffix, std::string_view body, const HTTPHeaderList &headers, string &out) {
+    size_t size = prepared.head.size() + pathSuffix.size() + prepared.tail.size() + body.size() + 40;
+    for (auto &header : headers) {
+        size += header.first.size() + header.second.size() + 4;
+    }
+    out.reserve(out.size() + size);
+    out.append(prepared.head);
+    out.append(pathSuffix.data(), pathSuffix.size());
+    out.append(prepared.tail);
+    for (auto &header : headers) {
+        out.append(header.first);
+        out.append(": ", 2);
+        out.append(header.second);
+        out.append("\r\n", 2);
+    }
+    if (prepared.sendsBody || !body.empty()) {
+        char digits[20];
+        int n = 0;
+        size_t length = body.size();
+        do {
+            digits[n++] = (char)('0' + length % 10);
+            length /= 10;
+        } while (length != 0);
+        out.append("Content-Length: ", 16);
+        while (n > 0) {
+            out += digits[--n];
+        }
+        out.append("\r\n", 2);
+    }
+    out.append("\r\n", 2);
+    out.append(body.data(), body.size());
+}
+
+//Will encode one send of a prepared request to a payload string
+string encode_payload(const HTTPPreparedRequest &prepared, std::string_view pathSuffix, std::string_view body, const HTTPHeaderList &headers) {
+    string result;
+    encodePrepared(prepared, pathSuffix, body, headers, result);
+    return result;
+}
+
+//Will send prepared with pathSuffix appended to its path, headers after the static ones and body, and return a HTTPResponse
+HTTPResponse HTTPSendPrepared(const HTTPPreparedRequest &prepared, std::string_view pathSuffix, std::string_view body, const HTTPHeaderList &headers) {
+    //Steady traffic on a thread encodes into the same buffer without allocating
+    thread_local string payload;
+    payload.clear();
+    encodePrepared(prepared, pathSuffix, body, headers, payload);
+    HTTPResponse response;
+    HTTPStreamHandlers handlers = collectResponse(response);
+    HTTPDispatch target = prepared.target;
+    target.bodySink = &response.body;
+    dispatchStream(target, payload, handlers);
+    response.ktls_active = target.ktlsActive;
+    if (payload.capacity() > PREPARED_BUFFER_KEEP) {
+        string().swap(payload);
+    }
+    return response;
+}
+
+//Will encode the request line and headers of a HTTPPostRequest whose body follows in chunked transfer encoding
+static string encodeChunkedHead(const HTTPPostRequest &request) {
+    string result;
+    result += "POST " + request.path + " HTTP/1.1\r\n";
+    result += "Host: " + hostHeader(request.host, request.port, request.isSsl) + "\r\n";
+    for (auto &header : request.headers) {
+        if (equalsIgnoreCase(header.first, "Content-Length") || equalsIgnoreCase(header.first, "Transfer-Encoding")) {
+            continue;
+        }
+        result += header.first + ": " + header.second + "\r\n";
+    }
+    result += "Transfer-Encoding: chunked\r\n\r\n";
+    return result;
+}
+
+//Will dispatch a HTTPPostRequest whose body is produced while it is sent and return a HTTPResponse
+HTTPResponse HTTPPostChunked(HTTPPostRequest request, HTTPBodyProducer producer) {
+    HTTPResponse response;
+    HTTPStreamHandlers handlers = collectResponse(response);
+    HTTPDispatch target = dispatchTarget(request);
+    target.bodySink = &response.body;
+    target.producer = &producer;
+    dispatchStream(target, encodeChunkedHead(request), handlers);
+    response.ktls_active = target.ktlsActive;
+    return response;
+}
+
+//Will dispatch a HTTPPostRequest whose body is read from input while it is sent and return a HTTPResponse
+HTTPResponse HTTPPostChunked(HTTPPostRequest request, std::istream &input) {
+    return HTTPPostChunked(request, [&input](char *buffer, size_t size) -> long long {
+        input.read(buffer, size);
+        if (input.bad()) {
+            return -1;
+        }
+        return input.gcount();
+    });
+}
+
+//Will dispatch a HTTPGetRequest to the server and stream the response into handlers
+bool HTTPGetStream(HTTPGetRequest request, HTTPStreamHandlers handlers) {
+    HTTPDispatch target = dispatchTarget(request);
+    target.streamed = true;
+    return dispatchStream(target, encode_payload(request), handlers);
+}
+
+//Will dispatch a HTTPPostRequest to its server and stream the response into handlers
+bool HTTPPostStream(HTTPPostRequest request, HTTPStreamHandlers handlers) {
+    HTTPDispatch target = dispatchTarget(request);
+    target.streamed = true;
+    string payload = encodePostPayload(request, target);
+    return dispatchStream(target, payload, handlers);
+}
+
+//Struct defining the state of a text/event-stream parser
+//Event fields are views into the body chunk being parsed while they fit in it, and are copied only when
+//an event spans two chunks or has several data lines
+struct SSEParser {
+    //Line cut off at the end of the previous chunk
+    string line;
+    bool skipLF = false;
+    bool started = false;
+    int bomMatched = 0;
+    //Fields of the event being parsed
+    std::string_view data;
+    std::string_view name;
+    bool hasData = false;
+    bool dataOwned = false;
+    bool nameOwned = false;
+    string ownedData;
+    string ownedName;
+    //Last event id and reconnection delay, kept across connections
+    string lastId;
+    int retryMs = 0;
+    bool delivered = false;
+};
+
+//Drops the event being parsed, used when a connection ends in the middle of one
+static void resetSSEEvent(SSEParser &parser) {
+    parser.line.clear();
+    parser.skipLF = false;
+    parser.started = false;
+    parser.bomMatched = 0;
+    parser.data = std::string_view();
+    parser.name = std::string_view();
+    parser.hasData = false;
+    parser.dataOwned = false;
+    parser.nameOwned = false;
+    parser.ownedData.clear();
+    parser.ownedName.clear();
+}
+
+//Handles one line of the stream, owned is set when line does not live in the current chunk
+//Returns false if on_event asked to stop
+static bool parseSSELine(SSEParser &parser, std::string_view line, bool owned, const std::function<bool(const SSEEvent &)> &on_event) {
+    if (line.empty()) {
+        if (!parser.hasData) {
+            parser.name = std::string_view();
+            parser.nameOwned = false;
+            return true;
+        }
+        SSEEvent event;
+        event.event = parser.name.empty() ? std::string_view("message") : parser.name;
+        event.data = parser.data;
+        event.id = parser.lastId;
+        bool keepGoing = on_event(event);
+        parser.delivered = true;
+        parser.data = std::string_view();
+        parser.name = std::string_view();
+        parser.hasData = false;
+        parser.dataOwned = false;
+        parser.nameOwned = false;
+        return keepGoing;
+    }
+    if (line[0] == ':') {
+        return true;
+    }
+    size_t colon = line.find(':');
+    std::string_view field = line.substr(0, colon);
+    std::string_view value;
+    if (colon != std::string_view::npos) {
+        value = line.substr(colon + 1);
+        if (!value.empty() && value[0] == ' ') {
+            value.remove_prefix(1);
+        }
+    }
+    if (field == "data") {
+        if (!parser.hasData && !owned) {
+            parser.data = value;
+        } else {
+            //Several data lines are joined with LF, which needs a buffer of its own
+            if (!parser.dataOwned) {
+                parser.ownedData.assign(parser.data.data(), parser.data.size());
+                parser.dataOwned = true;
+            }
+            if (parser.hasData) {
+                parser.ownedData += '\n';
+            }
+            parser.ownedData.append(value.data(), value.size());
+            parser.data = parser.ownedData;
+        }
+        parser.hasData = true;
+    } else if (field == "event") {
+        if (owned) {
+            parser.ownedName.assign(value.data(), value.size());
+            parser.name = parser.ownedName;
+        } else {
+            parser.name = value;
+        }
+        parser.nameOwned = owned;
+    } else if (field == "id") {
+        if (value.find('\0') == std::string_view::npos) {
+            parser.lastId.assign(value.data(), value.size());
+        }
+    } else if (field == "retry") {
+        if (!value.empty() && value.find_first_not_of("0123456789") == std::string_view::npos && value.size() < 10) {
+            parser.retryMs = atoi(string(value).c_str());
+        }
+    }
+    return true;
+}
+
+//Feeds one body chunk into parser, events are delivered as soon as their blank line arrives
+//Returns false if on_event asked to stop
+static bool feedSSEParser(SSEParser &parser, std::string_view chunk, const std::function<bool(const SSEEvent &)> &on_event) {
+    //A UTF-8 byte order mark in front of the stream is skipped, even when it is split across chunks
+    static const char bom[] = "\xEF\xBB\xBF";
+    while (!parser.started && !chunk.empty()) {
+        if (chunk[0] == bom[parser.bomMatched]) {
+            parser.bomMatched++;
+            chunk.remove_prefix(1);
+            parser.started = parser.bomMatched == 3;
+        } else {
+            parser.line.assign(bom, parser.bomMatched);
+            parser.started = true;
+        }
+    }
+    size_t pos = 0;
+    if (parser.skipLF && !chunk.empty() && chunk[0] == '\n') {
+        pos = 1;
+    }
+    parser.skipLF = false;
+    while (pos < chunk.size()) {
+        size_t end = chunk.find_first_of("\r\n", pos);
+        if (end == std::string_view::npos) {
+            parser.line.append(chunk.data() + pos, chunk.size() - pos);
+            break;
+        }
+        bool keepGoing;
+        if (parser.line.empty()) {
+            keepGoing = parseSSELine(parser, chunk.substr(pos, end - pos), false, on_event);
+        } else {
+            parser.line.append(chunk.data() + pos, end - pos);
+            keepGoing = parseSSELine(parser, parser.line, true, on_event);
+            parser.line.clear();
+        }
+        if (chunk[end] == '\r') {
+            if (end + 1 == chunk.size()) {
+                parser.skipLF = true;
+            } else if (chunk[end + 1] == '\n') {
+                end++;
+            }
+        }
+        pos = end + 1;
+        if (!keepGoing) {
+            return false;
+        }
+    }
+    //Fields that still point into this chunk are copied before it goes away
+    if (parser.hasData && !parser.dataOwned) {
+        parser.ownedData.assign(parser.data.data(), parser.data.size());
+        parser.data = parser.ownedData;
+        parser.dataOwned = true;
+    }
+    if (!parser.name.empty() && !parser.nameOwned) {
+        parser.ownedName.assign(parser.name.data(), parser.name.size());
+        parser.name = parser.ownedName;
+        parser.nameOwned = true;
+    }
+    return true;
+}
+
+//Will consume a text/event-stream, calling on_event for each event and reconnecting with Last-Event-ID when the stream ends
+bool HTTPEventStream(HTTPGetRequest request, std::function<bool(const SSEEvent &event)> on_event, SSEConfig config) {
+    addHeader(request, "Accept", "text/event-stream");
+    addHeader(request, "Cache-Control", "no-cache");
+    SSEParser parser;
+    parser.lastId = config.lastEventId;
+    parser.retryMs = config.retryMs;
+    int failures = 0;
+    while (true) {
+        if (!parser.lastId.empty()) {
+            addHeader(request, "Last-Event-ID", parser.lastId);
+        }
+        int status_code = 0;
+        bool eventStream = false;
+        bool stopped = false;
+        parser.delivered = false;
+        HTTPStreamHandlers handlers;
+        handlers.on_status = [&status_code](int code) {
+            status_code = code;
+            return code == 200;
+        };
+        handlers.on_header = [&eventStream](const string &key, const string &value) {
+            if (equalsIgnoreCase(key, "Content-Type")) {
+                eventStream = value.compare(0, 17, "text/event-stream") == 0;
+                return eventStream;
+            }
+            return true;
+        };
+        handlers.on_body_chunk = [&](std::string_view chunk) {
+            stopped = !feedSSEParser(parser, chunk, on_event);
+            return !stopped;
+        };
+        HTTPDispatch target = dispatchTarget(request);
+        target.streamed = true;
+        dispatchStream(target, encode_payload(request), handlers);
+        if (stopped) {
+            return true;
+        }
+        //204 tells the client to stop, any other answer that is not an event stream is final
+        if (status_code == 204) {
+            return true;
+        }
+        if (status_code != 0 && (status_code != 200 || !eventStream)) {
+            return false;
+        }
+        failures = parser.delivered ? 0 : failures + 1;
+        if (config.maxReconnects > 0 && failures > config.maxReconnects) {
+            return false;
+        }
+        resetSSEEvent(parser);
+        std::this_thread::sleep_for(std::chrono::milliseconds(parser.retryMs));
+    }
+}
+
+//Returns the 20 byte SHA-1 digest of data, only used to check the WebSocket handshake
+static string sha1(std::string_view data) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    string message(data);
+    unsigned long long bits = (unsigned long long)data.size() * 8;
+    message += (char)0x80;
+    while (message.size() % 64 != 56) {
+        message += (char)0;
+    }
+    for (int i = 7; i >= 0; i--) {
+        message += (char)(bits >> (i * 8));
+    }
+    auto rotl = [](uint32_t value, int count) {
+        return (value << count) | (value >> (32 - count));
+    };
+    for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+        uint32_t w[80];
+        const unsigned char *block = (const unsigned char *)message.data() + chunk;
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    string digest;
+    for (int i = 0; i < 5; i++) {
+        for (int j = 3; j >= 0; j--) {
+            digest += (char)(h[i] >> (j * 8));
+        }
+    }
+    return digest;
+}
+
+//XORs len bytes of src with the repeating 4 byte WebSocket mask into dst, 16 or 8 bytes at a time
+//dst may equal src
+static void maskCopy(char *dst, const char *src, size_t len, const unsigned char mask[4]) {
+    unsigned char pattern[16];
+    for (int i = 0; i < 16; i++) {
+        pattern[i] = mask[i % 4];
+    }
+    size_t i = 0;
+#if defined(REQUESTS_X86_SIMD) && defined(__SSE2__)
+    __m128i wide = _mm_loadu_si128((const __m128i *)pattern);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(block, wide));
+    }
+#endif
+    uint64_t word;
+    memcpy(&word, pattern, 8);
+    for (; i + 8 <= len; i += 8) {
+        uint64_t block;
+        memcpy(&block, src + i, 8);
+        block ^= word;
+        memcpy(dst + i, &block, 8);
+    }
+    //i is a multiple of 4 here, so the mask phase starts at mask[0]
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ mask[i % 4];
+    }
+}
+
+//Magic value appended to Sec-WebSocket-Key before hashing (RFC 6455)
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+//Messages shorter than this are sent uncompressed, deflate would only make them larger
+#define WEBSOCKET_DEFLATE_MIN 64
+
+//Struct defining an open WebSocket
+struct WebSocket {
+    HTTPConnection conn;
+    WebSocketConfig config;
+    //Received bytes not yet parsed start at buffer[offset]
+    string buffer;
+    size_t offset = 0;
+    //Data frames of a fragmented message received so far
+    string partial;
+    int partialOpcode = 0;
+    bool partialCompressed = false;
+    bool closeSent = false;
+    bool closed = false;
+    string protocol;
+    //permessage-deflate state, negotiated in the handshake
+    bool deflate = false;
+    bool compressSends = false;
+    bool clientNoContextTakeover = false;
+    bool serverNoContextTakeover = false;
+#ifndef REQUESTS_NO_ZLIB
+    z_stream deflater;
+    z_stream inflater;
+#endif
+
+    ~WebSocket() {
+#ifndef REQUESTS_NO_ZLIB
+        if (deflate) {
+            deflateEnd(&deflater);
+            inflateEnd(&inflater);
+        }
+#endif
+        closeConnection(conn);
+    }
+};
+
+//Makes at least count unparsed bytes available in ws.buffer, returns false if the connection ended first
+static bool fillWebSocket(WebSocket &ws, size_t count) {
+    while (ws.buffer.size() - ws.offset < count) {
+        if (ws.offset > 0) {
+            ws.buffer.erase(0, ws.offset);
+            ws.offset = 0;
+        }
+        size_t have = ws.buffer.size();
+        size_t want = std::max<size_t>(count - have, MIN_READ_SIZE);
+        want = std::min<size_t>(want, INT_MAX);
+        ws.buffer.resize(have + want);
+        int read = connectionRead(ws.conn, &ws.buffer[have], (int)want);
+        ws.buffer.resize(have + (read > 0 ? read : 0));
+        if (read <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Fills out with unpredictable bytes for masks and handshake keys, which RFC 6455 requires to come from a strong source
+//OpenSSL's generator is used when it is built in, otherwise the system one behind std::random_device
+static void randomBytes(unsigned char *out, size_t len) {
+#ifndef REQUESTS_NO_TLS
+    if (RAND_bytes(out, (int)len) == 1) {
+        return;
+    }
+#endif
+    //Opening the device is the expensive part, so each thread keeps one
+    thread_local std::random_device entropy;
+    for (size_t i = 0; i < len; i += 4) {
+        uint32_t random = entropy();
+        memcpy(out + i, &random, std::min<size_t>(4, len - i));
+    }
+}
+
+//Sends one frame with a fresh mask, the header and masked payload go out in a single write
+static bool sendWebSocketFrame(WebSocket &ws, int opcode, std::string_view payload, bool fin, bool compressed) {
+    string frame;
+    frame.resize(14 + payload.size());
+    unsigned char *header = (unsigned char *)&frame[0];
+    header[0] = (fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | (opcode & 0x0F);
+    size_t length = 2;
+    if (payload.size() < 126) {
+        header[1] = 0x80 | (unsigned char)payload.size();
+    } else if (payload.size() <= 0xFFFF) {
+        header[1] = 0x80 | 126;
+        header[2] = (unsigned char)(payload.size() >> 8);
+        header[3] = (unsigned char)payload.size();
+        length = 4;
+    } else {
+        header[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (unsigned char)((unsigned long long)payload.size() >> (56 - i * 8));
+        }
+        length = 10;
+    }
+    unsigned char *mask = header + length;
+    randomBytes(mask, 4);
+    length += 4;
+    maskCopy(&frame[length], payload.data(), payload.size(), mask);
+    frame.resize(length + payload.size());
+    return connectionWrite(ws.conn, frame.data(), frame.size());
+}
+
+#ifndef REQUESTS_NO_ZLIB
+//Compresses a message for permessage-deflate, the trailing 00 00 FF FF of the flush is dropped
+static bool deflateMessage(WebSocket &ws, std::string_view data, string &out) {
+    out.clear();
+    ws.deflater.next_in = (Bytef *)data.data();
+    ws.deflater.avail_in = (uInt)data.size();
+    do {
+        size_t have = out.size();
+        out.resize(have + deflateBound(&ws.deflater, (uLong)data.size()) + 16);
+        ws.deflater.next_out = (Bytef *)&out[have];
+        ws.deflater.avail_out = (uInt)(out.size() - have);
+        if (deflate(&ws.deflater, Z_SYNC_FLUSH) != Z_OK) {
+            return false;
+        }
+        out.resize(out.size() - ws.deflater.avail_out);
+    } while (ws.deflater.avail_in > 0 || ws.deflater.avail_out == 0);
+    if (out.size() >= 4 && out.compare(out.size() - 4, 4, string("\x00\x00\xff\xff", 4)) == 0) {
+        out.resize(out.size() - 4);
+    }
+    if (out.empty()) {
+        out.assign(1, '\0');
+    }
+    if (ws.clientNoContextTakeover) {
+        deflateReset(&ws.deflater);
+    }
+    return true;
+}
+
+//Decompresses a permessage-deflate message, refusing output larger than the configured message limit
+static bool inflateMessage(WebSocket &ws, string &compressed, string &out) {
+    out.clear();
+    compressed.append("\x00\x00\xff\xff", 4);
+    ws.inflater.next_in = (Bytef *)compressed.data();
+    ws.inflater.avail_in = (uInt)compressed.size();
+    while (true) {
+        size_t have = out.size();
+        out.resize(have + std::max<size_t>(compressed.size() * 4, 16384));
+        ws.inflater.next_out = (Bytef *)&out[have];
+        ws.inflater.avail_out = (uInt)(out.size() - have);
+        int result = inflate(&ws.inflater, Z_SYNC_FLUSH);
+        out.resize(out.size() - ws.inflater.avail_out);
+        if (out.size() > ws.config.maxMessageSize) {
+            return false;
+        }
+        if (result == Z_STREAM_END) {
+            //The sender ended its deflate stream, the next message starts a new one
+            inflateReset(&ws.inflater);
+            break;
+        }
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+        }
+        if (ws.inflater.avail_in == 0 && ws.inflater.avail_out != 0) {
+            break;
+        }
+    }
+    if (ws.serverNoContextTakeover) {
+        inflateReset(&ws.inflater);
+    }
+    return true;
+}
+#endif
+
+//Reads the parameters the server accepted for permessage-deflate from its Sec-WebSocket-Extensions header
+//Returns false if the server answered with an extension that was not offered
+static bool acceptWebSocketExtensions(WebSocket &ws, const string &header) {
+    if (header.empty()) {
+        return true;
+    }
+    std::vector<string> parameters = split(header, ';');
+    for (string &parameter : parameters) {
+        parameter.erase(0, parameter.find_first_not_of(" \t"));
+        parameter.erase(parameter.find_last_not_of(" \t") + 1);
+    }
+    if (parameters.empty() || parameters[0] != "permessage-deflate" || !ws.config.permessageDeflate || header.find(',') != string::npos) {
+        return false;
+    }
+#ifndef REQUESTS_NO_ZLIB
+    int clientBits = 15;
+    for (size_t i = 1; i < parameters.size(); i++) {
+        if (parameters[i] == "client_no_context_takeover") {
+            ws.clientNoContextTakeover = true;
+        } else if (parameters[i] == "server_no_context_takeover") {
+            ws.serverNoContextTakeover = true;
+        } else if (parameters[i].compare(0, 23, "client_max_window_bits=") == 0) {
+            clientBits = atoi(parameters[i].c_str() + 23);
+        }
+    }
+    memset(&ws.deflater, 0, sizeof(ws.deflater));
+    memset(&ws.inflater, 0, sizeof(ws.inflater));
+    //zlib can not produce an 8 bit window, messages are then sent uncompressed
+    ws.compressSends = clientBits >= 9 && clientBits <= 15;
+    if (deflateInit2(&ws.deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -(ws.compressSends ? clientBits : 15), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    if (inflateInit2(&ws.inflater, -15) != Z_OK) {
+        deflateEnd(&ws.deflater);
+        return false;
+    }
+    ws.deflate = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+//Will open a WebSocket to a ws:// or wss:// request and complete the Upgrade handshake
+std::shared_ptr<WebSocket> WebSocketConnect(HTTPGetRequest request, WebSocketConfig config) {
+    std::shared_ptr<WebSocket> ws = std::make_shared<WebSocket>();
+    ws->config = config;
+    HTTPDispatch target = dispatchTarget(request);
+    ProxyRoute route;
+    //Upgrades are not understood by every forward proxy, so ws:// is tunnelled with CONNECT as well
+    bool connected;
+    if (!target.socketPath.empty()) {
+        connected = openUnixConnection(ws->conn, target);
+    } else if (proxyRoute(target, route)) {
+        connected = openProxyConnection(ws->conn, target, route, true);
+    } else {
+        connected = openConnection(ws->conn, target.ipaddr, target.port, target.isSsl, target.verify, target.host);
+    }
+    if (!connected) {
+        return nullptr;
+    }
+    unsigned char nonce[16];
+    randomBytes(nonce, sizeof(nonce));
+    string key = base64Encode(std::string_view((const char *)nonce, sizeof(nonce)));
+    addHeader(request, "Upgrade", "websocket");
+    addHeader(request, "Connection", "Upgrade");
+    addHeader(request, "Sec-WebSocket-Key", key);
+    addHeader(request, "Sec-WebSocket-Version", "13");
+    if (!config.protocols.empty()) {
+        string protocols;
+        for (const string &protocol : config.protocols) {
+            protocols += (protocols.empty() ? "" : ", ") + protocol;
+        }
+        addHeader(request, "Sec-WebSocket-Protocol", protocols);
+    }
+#ifndef REQUESTS_NO_ZLIB
+    if (config.permessageDeflate) {
+        addHeader(request, "Sec-WebSocket-Extensions", "permessage-deflate; client_max_window_bits");
+    }
+#else
+    ws->config.permessageDeflate = false;
+#endif
+    string payload = encode_payload(request);
+    if (!connectionWrite(ws->conn, payload.data(), payload.size())) {
+        return nullptr;
+    }
+
+    int status_code = 0;
+    string upgrade, accept, extensions;
+    HTTPStreamHandlers handlers;
+    handlers.on_status = [&status_code](int code) {
+        status_code = code;
+        return true;
+    };
+    handlers.on_header = [&](const string &key, const string &value) {
+        if (equalsIgnoreCase(key, "Upgrade")) {
+            upgrade = value;
+        } else if (equalsIgnoreCase(key, "Sec-WebSocket-Accept")) {
+            accept = value;
+        } else if (equalsIgnoreCase(key, "Sec-WebSocket-Extensions")) {
+            extensions = value;
+        } else if (equalsIgnoreCase(key, "Sec-WebSocket-Protocol")) {
+            ws->protocol = value;
+        }
+        return true;
+    };
+    //Frames sent right after the 101 can share a read with it, they stay in the buffer
+    HTTPResponseParser parser;
+    initResponseParser(parser, handlers, true);
+    setResponseLimits(parser, request.maxHeaderBytes, 0);
+    char buffer[MIN_READ_SIZE];
+    while (parser.state != PARSE_DONE) {
+        int read = connectionRead(ws->conn, buffer, sizeof(buffer));
+        if (read <= 0) {
+            return nullptr;
+        }
+        size_t consumed = feedResponseParser(parser, buffer, read);
+        if (parser.state == PARSE_ERROR) {
+            return nullptr;
+        }
+        ws->buffer.append(buffer + consumed, read - consumed);
+    }
+    if (status_code != 101 || !equalsIgnoreCase(upgrade, "websocket") || accept != base64Encode(sha1(key + WEBSOCKET_GUID))) {
+        return nullptr;
+    }
+    if (!acceptWebSocketExtensions(*ws, extensions)) {
+        return nullptr;
+    }
+    return ws;
+}
+
+//Will return the subprotocol the server selected, empty if none
+std::string WebSocketProtocol(WebSocket &ws) {
+    return ws.protocol;
+}
+
+//Will send one message, data messages longer than maxFrameSize are fragmented
+bool WebSocketSend(WebSocket &ws, std::string_view data, int opcode) {
+    if (ws.closeSent || ws.closed) {
+        return false;
+    }
+    if (opcode >= WS_CLOSE) {
+        return data.size() <= 125 && sendWebSocketFrame(ws, opcode, data, true, false);
+    }
+    if (opcode != WS_TEXT && opcode != WS_BINARY) {
+        return false;
+    }
+    bool compressed = false;
+#ifndef REQUESTS_NO_ZLIB
+    string deflated;
+    if (ws.deflate && ws.compressSends && data.size() >= WEBSOCKET_DEFLATE_MIN) {
+        if (!deflateMessage(ws, data, deflated)) {
+            return false;
+        }
+        data = deflated;
+        compressed = true;
+    }
+#endif
+    size_t frameSize = ws.config.maxFrameSize > 0 ? ws.config.maxFrameSize : data.size();
+    size_t sent = 0;
+    do {
+        size_t size = std::min(frameSize, data.size() - sent);
+        bool fin = sent + size == data.size();
+        if (!sendWebSocketFrame(ws, sent == 0 ? opcode : WS_CONTINUATION, data.substr(sent, size), fin, compressed && sent == 0)) {
+            return false;
+        }
+        sent += size;
+    } while (sent < data.size());
+    return true;
+}
+
+//Marks ws closed after a protocol violation, telling the server why when possible
+//1006 means the connection dropped, it is never sent
+static bool failWebSocket(WebSocket &ws, int code) {
+    if (!ws.closeSent && code != 1006) {
+        string payload = { (char)(code >> 8), (char)code };
+        sendWebSocketFrame(ws, WS_CLOSE, payload, true, false);
+        ws.closeSent = true;
+    }
+    ws.closed = true;
+    closeConnection(ws.conn);
+    return false;
+}
+
+//Will wait for the next message, pings are answered automatically and also returned
+bool WebSocketReceive(WebSocket &ws, WebSocketMessage &message) {
+    if (ws.closed) {
+        return false;
+    }
+    while (true) {
+        if (!fillWebSocket(ws, 2)) {
+            return failWebSocket(ws, 1006);
+        }
+        const unsigned char *header = (const unsigned char *)ws.buffer.data() + ws.offset;
+        bool fin = header[0] & 0x80;
+        bool compressed = header[0] & 0x40;
+        int opcode = header[0] & 0x0F;
+        bool masked = header[1] & 0x80;
+        unsigned long long length = header[1] & 0x7F;
+        size_t headerSize = 2 + (length == 126 ? 2 : length == 127 ? 8 : 0) + (masked ? 4 : 0);
+        //Servers never mask their frames and only permessage-deflate may set RSV1
+        if (masked || (header[0] & 0x30) || (compressed && (!ws.deflate || opcode == WS_CONTINUATION || opcode >= WS_CLOSE))) {
+            return failWebSocket(ws, 1002);
+        }
+        if (!fillWebSocket(ws, headerSize)) {
+            return failWebSocket(ws, 1006);
+        }
+        header = (const unsigned char *)ws.buffer.data() + ws.offset;
+        if (length == 126) {
+            length = (unsigned long long)header[2] << 8 | header[3];
+        } else if (length == 127) {
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = length << 8 | header[2 + i];
+            }
+        }
+        if (length > ws.config.maxMessageSize || ws.partial.size() + length > ws.config.maxMessageSize) {
+            return failWebSocket(ws, 1009);
+        }
+        if (!fillWebSocket(ws, headerSize + (size_t)length)) {
+            return failWebSocket(ws, 1006);
+        }
+        std::string_view payload(ws.buffer.data() + ws.offset + headerSize, (size_t)length);
+        ws.offset += headerSize + (size_t)length;
+
+        if (opcode >= WS_CLOSE) {
+            if (!fin || length > 125 || (opcode != WS_CLOSE && opcode != WS_PING && opcode != WS_PONG)) {
+                return failWebSocket(ws, 1002);
+            }
+            message.opcode = opcode;
+            message.closeCode = 0;
+            message.data.assign(payload.data(), payload.size());
+            if (opcode == WS_PING && ws.config.autoPong && !ws.closeSent) {
+                sendWebSocketFrame(ws, WS_PONG, payload, true, false);
+            } else if (opcode == WS_CLOSE) {
+                message.closeCode = 1005;
+                if (payload.size() >= 2) {
+                    message.closeCode = (unsigned char)payload[0] << 8 | (unsigned char)payload[1];
+                    message.data.erase(0, 2);
+                }
+                //Echo the close code unless this answers our own close
+                if (!ws.closeSent) {
+                    sendWebSocketFrame(ws, WS_CLOSE, payload.substr(0, 2), true, false);
+                    ws.closeSent = true;
+                }
+                ws.closed = true;
+                closeConnection(ws.conn);
+            }
+            return true;
+        }
+        if (opcode == WS_CONTINUATION) {
+            if (ws.partialOpcode == 0) {
+                return failWebSocket(ws, 1002);
+            }
+        } else if (opcode == WS_TEXT || opcode == WS_BINARY) {
+            if (ws.partialOpcode != 0) {
+                return failWebSocket(ws, 1002);
+            }
+            ws.partialOpcode = opcode;
+            ws.partialCompressed = compressed;
+        } else {
+            return failWebSocket(ws, 1002);
+        }
+        ws.partial.append(payload.data(), payload.size());
+        if (!fin) {
+            continue;
+        }
+        message.opcode = ws.partialOpcode;
+        message.closeCode = 0;
+#ifndef REQUESTS_NO_ZLIB
+        if (ws.partialCompressed) {
+            if (!inflateMessage(ws, ws.partial, message.data)) {
+                return failWebSocket(ws, 1007);
+            }
+        } else {
+            message.data.swap(ws.partial);
+        }
+#else
+        message.data.swap(ws.partial);
+#endif
+        ws.partial.clear();
+        ws.partialOpcode = 0;
+        return true;
+    }
+}
+
+//Will send a close frame and wait for the server to answer it, messages received meanwhile are dropped
+bool WebSocketClose(WebSocket &ws, int code, std::string reason) {
+    if (ws.closeSent || ws.closed) {
+        return false;
+    }
+    string payload = { (char)(code >> 8), (char)code };
+    payload += reason.substr(0, 123);
+    ws.closeSent = true;
+    if (!sendWebSocketFrame(ws, WS_CLOSE, payload, true, false)) {
+        ws.closed = true;
+        closeConnection(ws.conn);
+        return false;
+    }
+    WebSocketMessage message;
+    while (WebSocketReceive(ws, message) && message.opcode != WS_CLOSE) {
+    }
+    ws.closed = true;
+    closeConnection(ws.conn);
+    return true;
+}
+
+//JSON documents are indexed in blocks of this many bytes, one bit per byte in each mask
+#define JSON_BLOCK 64
+
+//Struct defining a lazily parsed JSON document
+//index holds the offset of every unescaped quote and every {}[]:, outside strings, values are found by walking it
+struct JSONView {
+    string data;
+    std::vector<uint32_t> index;
+    //data[0, scanned) was indexed in whole blocks, the entries of the partial last block start at blockEntries
+    size_t scanned = 0;
+    size_t blockEntries = 0;
+    //Carried from the last whole block: the next byte is escaped, the next byte is inside a string (all ones)
+    uint64_t escaped = 0;
+    uint64_t inString = 0;
+};
+
+//Struct defining the kernel that marks the backslashes, quotes and {}[]:, of a 64 byte block
+struct JSONScanKernel {
+    const char *name;
+    void (*classify)(const char *block, uint64_t &backslash, uint64_t &quote, uint64_t &op);
+};
+
+static void classifyJSONScalar(const char *block, uint64_t &backslash, uint64_t &quote, uint64_t &op) {
+    backslash = quote = op = 0;
+    for (int i = 0; i < JSON_BLOCK; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (block[i]) {
+        case '\\':
+            backslash |= bit;
+            break;
+        case '"':
+            quote |= bit;
+            break;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            op |= bit;
+            break;
+        }
+    }
+}
+
+#if defined(REQUESTS_X86_SIMD) && defined(__SSE2__)
+//SSE2 and AVX2 kernels, '[' and ']' only differ from '{' and '}' in bit 0x20 so two compares find all four
+static void classifyJSONSSE2(const char *block, uint64_t &backslash, uint64_t &quote, uint64_t &op) {
+    const __m128i lower = _mm_set1_epi8(0x20);
+    backslash = quote = op = 0;
+    for (int i = 0; i < JSON_BLOCK; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i folded = _mm_or_si128(b, lower);
+        __m128i brackets = _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}')));
+        __m128i separators = _mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8(':')), _mm_cmpeq_epi8(b, _mm_set1_epi8(',')));
+        backslash |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8('\\'))) << i;
+        quote |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8('"'))) << i;
+        op |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_or_si128(brackets, separators)) << i;
+    }
+}
+#endif
+
+#ifdef REQUESTS_X86_SIMD
+__attribute__((target("avx2")))
+static void classifyJSONAVX2(const char *block, uint64_t &backslash, uint64_t &quote, uint64_t &op) {
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    backslash = quote = op = 0;
+    for (int i = 0; i < JSON_BLOCK; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i folded = _mm256_or_si256(b, lower);
+        __m256i brackets = _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}')));
+        __m256i separators = _mm256_or_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(b, _mm256_set1_epi8(',')));
+        backslash |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('\\'))) << i;
+        quote |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('"'))) << i;
+        op |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(brackets, separators)) << i;
+    }
+}
+#endif
+
+static const JSONScanKernel json_scalar_kernel = { "scalar", classifyJSONScalar };
+#if defined(REQUESTS_X86_SIMD) && defined(__SSE2__)
+static const JSONScanKernel json_sse2_kernel = { "sse2", classifyJSONSSE2 };
+#endif
+#ifdef REQUESTS_X86_SIMD
+static const JSONScanKernel json_avx2_kernel = { "avx2", classifyJSONAVX2 };
+#endif
+
+//Picks the widest JSON kernel supported by the running cpu
+static const JSONScanKernel *detectJSONScanKernel() {
+#ifdef REQUESTS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &json_avx2_kernel;
+    }
+#endif
+#if defined(REQUESTS_X86_SIMD) && defined(__SSE2__)
+    return &json_sse2_kernel;
+#else
+    return &json_scalar_kernel;
+#endif
+}
+
+//Kernel in use, chosen once at startup
+static const JSONScanKernel *const json_scan = detectJSONScanKernel();
+
+//Returns the position of the lowest set bit of mask, mask must not be 0
+static inline int lowestBit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    int bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+//Returns how many bits of mask are set
+static inline int bitCount(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(mask);
+#else
+    int bits = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        bits++;
+    }
+    return bits;
+#endif
+}
+
+//Appends the structural characters of the block at base to view.index
+//A quote is escaped when an odd run of backslashes precedes it, runs are told apart with one addition (as in simdjson)
+//The string mask is the prefix xor of the unescaped quotes, so the carries are all the state a block needs
+static void indexJSONBlock(JSONView &view, size_t base, uint64_t backslash, uint64_t quote, uint64_t op, uint64_t &escaped, uint64_t &inString) {
+    const uint64_t even = 0x5555555555555555ULL;
+    backslash &= ~escaped;
+    uint64_t followsEscape = (backslash << 1) | escaped;
+    uint64_t oddStarts = backslash & ~even & ~followsEscape;
+    uint64_t evenStarts = oddStarts + backslash;
+    escaped = evenStarts < oddStarts ? 1 : 0;
+    quote &= ~((even ^ (evenStarts << 1)) & followsEscape);
+    uint64_t strings = quote;
+    strings ^= strings << 1;
+    strings ^= strings << 2;
+    strings ^= strings << 4;
+    strings ^= strings << 8;
+    strings ^= strings << 16;
+    strings ^= strings << 32;
+    strings ^= inString;
+    inString = (uint64_t)0 - (strings >> 63);
+    uint64_t structural = (op & ~strings) | quote;
+    size_t at = view.index.size();
+    view.index.resize(at + bitCount(structural));
+    uint32_t *out = view.index.data() + at;
+    while (structural != 0) {
+        *out++ = (uint32_t)(base + lowestBit(structural));
+        structural &= structural - 1;
+    }
+}
+
+//Indexes the whole blocks appended since the last call, then the partial last block from a space padded copy
+//The carries of the partial block are thrown away, it is indexed again once more data arrives
+static void indexJSONData(JSONView &view, const JSONScanKernel &kernel) {
+    uint64_t backslash, quote, op;
+    view.index.resize(view.blockEntries);
+    while (view.data.size() - view.scanned >= JSON_BLOCK) {
+        kernel.classify(view.data.data() + view.scanned, backslash, quote, op);
+        indexJSONBlock(view, view.scanned, backslash, quote, op, view.escaped, view.inString);
+        view.scanned += JSON_BLOCK;
+    }
+    view.blockEntries = view.index.size();
+    size_t rest = view.data.size() - view.scanned;
+    if (rest > 0) {
+        char block[JSON_BLOCK];
+        memset(block, ' ', JSON_BLOCK);
+        memcpy(block, view.data.data() + view.scanned, rest);
+        uint64_t escaped = view.escaped;
+        uint64_t inString = view.inString;
+        kernel.classify(block, backslash, quote, op);
+        indexJSONBlock(view, view.scanned, backslash, quote, op, escaped, inString);
+    }
+}
+
+//Will index json for lazy field access, pass the body with std::move to avoid copying it
+//Returns nullptr for documents of 4GB or more
+std::shared_ptr<JSONView> JSONViewCreate(string json) {
+    if (json.size() >= UINT32_MAX) {
+        return nullptr;
+    }
+    std::shared_ptr<JSONView> view = std::make_shared<JSONView>();
+    view->data = std::move(json);
+    indexJSONData(*view, *json_scan);
+    return view;
+}
+
+//Will append the next piece of a document that is still arriving, only the new bytes are indexed
+bool JSONViewAppend(JSONView &view, std::string_view data) {
+    if (view.data.size() + data.size() >= UINT32_MAX) {
+        return false;
+    }
+    view.data.append(data.data(), data.size());
+    indexJSONData(view, *json_scan);
+    return true;
+}
+
+//Struct defining a value found in a JSONView, its bytes and the index entries it spans
+//An array or object that has not fully arrived runs to the end of the data with complete = false
+struct JSONSpan {
+    size_t begin = 0;
+    size_t end = 0;
+    size_t first = 0;
+    size_t next = 0;
+    bool complete = true;
+};
+
+static inline bool is_json_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+//Finds the value that starts at or after byte pos, entry is the first index entry at or after pos
+//Returns false when there is no value there, or a string or scalar that has not fully arrived
+static bool jsonSpanAt(const JSONView &view, size_t pos, size_t entry, JSONSpan &span) {
+    const string &data = view.data;
+    const std::vector<uint32_t> &index = view.index;
+    while (pos < data.size() && is_json_space(data[pos])) {
+        pos++;
+    }
+    if (pos >= data.size()) {
+        return false;
+    }
+    span.begin = pos;
+    span.first = entry;
+    span.complete = true;
+    char c = data[pos];
+    if (c == '"') {
+        //Only quotes are indexed inside a string, so the next entry closes it
+        if (entry + 1 >= index.size() || index[entry] != pos) {
+            return false;
+        }
+        span.end = index[entry + 1] + 1;
+        span.next = entry + 2;
+        return true;
+    }
+    if (c == '{' || c == '[') {
+        if (entry >= index.size() || index[entry] != pos) {
+            return false;
+        }
+        int depth = 0;
+        for (size_t i = entry; i < index.size(); i++) {
+            char s = data[index[i]];
+            if (s == '{' || s == '[') {
+                depth++;
+            } else if ((s == '}' || s == ']') && --depth == 0) {
+                span.end = index[i] + 1;
+                span.next = i + 1;
+                return true;
+            }
+        }
+        //Members that have already arrived can be looked up
+        span.end = data.size();
+        span.next = index.size();
+        span.complete = false;
+        return true;
+    }
+    if (c == '}' || c == ']' || c == ',' || c == ':') {
+        return false;
+    }
+    //Numbers, true, false and null run up to the next structural character, or the end of a scalar document
+    size_t end;
+    if (entry < index.size()) {
+        end = index[entry];
+    } else if (index.empty()) {
+        end = data.size();
+    } else {
+        return false;
+    }
+    while (end > pos && is_json_space(data[end - 1])) {
+        end--;
+    }
+    span.end = end;
+    span.next = entry;
+    return true;
+}
+
+//Steps to the next member or element of container, pos and entry start just inside its opening bracket
+//key is set to the raw name of object members, returns false after the last one
+static bool jsonNextItem(const JSONView &view, const JSONSpan &container, size_t &pos, size_t &entry, std::string_view &key, JSONSpan &item) {
+    const string &data = view.data;
+    const std::vector<uint32_t> &index = view.index;
+    while (pos < container.end && is_json_space(data[pos])) {
+        pos++;
+    }
+    if (pos + 1 >= container.end) {
+        return false;
+    }
+    if (data[container.begin] == '{') {
+        if (entry + 2 >= container.next || index[entry] != pos || data[index[entry + 2]] != ':') {
+            return false;
+        }
+        key = std::string_view(data.data() + index[entry] + 1, index[entry + 1] - index[entry] - 1);
+        pos = index[entry + 2] + 1;
+        entry += 3;
+    }
+    if (!jsonSpanAt(view, pos, entry, item)) {
+        return false;
+    }
+    //A partial item is the last one that has arrived
+    if (!item.complete) {
+        pos = container.end;
+        entry = item.next;
+        return true;
+    }
+    if (item.next >= container.next) {
+        return false;
+    }
+    entry = item.next;
+    if (data[index[entry]] == ',') {
+        pos = index[entry] + 1;
+        entry++;
+    } else {
+        pos = container.end - 1;
+    }
+    return true;
+}
+
+//Decodes the JSON escapes of a raw string body into value, \u escapes become UTF-8
+static bool unescapeJSON(std::string_view raw, string &value) {
+    value.clear();
+    value.reserve(raw.size());
+    for (size_t i = 0; i < raw.size(); i++) {
+        if (raw[i] != '\\') {
+            value += raw[i];
+            continue;
+        }
+        if (++i >= raw.size()) {
+            return false;
+        }
+        switch (raw[i]) {
+        case '"': value += '"'; break;
+        case '\\': value += '\\'; break;
+        case '/': value += '/'; break;
+        case 'b': value += '\b'; break;
+        case 'f': value += '\f'; break;
+        case 'n': value += '\n'; break;
+        case 'r': value += '\r'; break;
+        case 't': value += '\t'; break;
+        case 'u': {
+            auto hex4 = [&raw](size_t at, unsigned long &code) {
+                if (at + 4 > raw.size()) {
+                    return false;
+                }
+                string digits(raw.substr(at, 4));
+                char *end;
+                code = strtoul(digits.c_str(), &end, 16);
+                return end == digits.c_str() + 4;
+            };
+            unsigned long code;
+            if (!hex4(i + 1, code)) {
+                return false;
+            }
+            i += 4;
+            //A high surrogate pairs with the \u escape after it
+            if (code >= 0xd800 && code < 0xdc00) {
+                unsigned long low;
+                if (i + 2 >= raw.size() || raw[i + 1] != '\\' || raw[i + 2] != 'u' || !hex4(i + 3, low) || low < 0xdc00 || low > 0xdfff) {
+                    return false;
+                }
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                i += 6;
+            } else if (code >= 0xdc00 && code <= 0xdfff) {
+                return false;
+            }
+            if (code < 0x80) {
+                value += (char)code;
+            } else if (code < 0x800) {
+                value += (char)(0xc0 | (code >> 6));
+                value += (char)(0x80 | (code & 0x3f));
+            } else if (code < 0x10000) {
+                value += (char)(0xe0 | (code >> 12));
+                value += (char)(0x80 | ((code >> 6) & 0x3f));
+                value += (char)(0x80 | (code & 0x3f));
+            } else {
+                value += (char)(0xf0 | (code >> 18));
+                value += (char)(0x80 | ((code >> 12) & 0x3f));
+                value += (char)(0x80 | ((code >> 6) & 0x3f));
+                value += (char)(0x80 | (code & 0x3f));
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+//Follows an RFC 6901 pointer such as "/items/0/name" from the root, "" is the whole document
+static bool jsonFind(const JSONView &view, const string &pointer, JSONSpan &span) {
+    if (!jsonSpanAt(view, 0, 0, span)) {
+        return false;
+    }
+    if (!pointer.empty() && pointer[0] != '/') {
+        return false;
+    }
+    size_t at = 0;
+    while (at < pointer.size()) {
+        size_t slash = pointer.find('/', at + 1);
+        if (slash == string::npos) {
+            slash = pointer.size();
+        }
+        string token;
+        for (size_t i = at + 1; i < slash; i++) {
+            if (pointer[i] == '~' && i + 1 < slash && (pointer[i + 1] == '0' || pointer[i + 1] == '1')) {
+                token += pointer[++i] == '0' ? '~' : '/';
+            } else {
+                token += pointer[i];
+            }
+        }
+        at = slash;
+        char kind = view.data[span.begin];
+        size_t wanted = 0;
+        if (kind == '[') {
+            if (token.empty() || token.find_first_not_of("0123456789") != string::npos || (token.size() > 1 && token[0] == '0')) {
+                return false;
+            }
+            wanted = strtoull(token.c_str(), NULL, 10);
+        } else if (kind != '{') {
+            return false;
+        }
+        size_t pos = span.begin + 1;
+        size_t entry = span.first + 1;
+        size_t n = 0;
+        std::string_view key;
+        JSONSpan item;
+        string decoded;
+        bool found = false;
+        while (!found && jsonNextItem(view, span, pos, entry, key, item)) {
+            if (kind == '[') {
+                found = n++ == wanted;
+            } else if (key.find('\\') == std::string_view::npos) {
+                found = key == token;
+            } else {
+                found = unescapeJSON(key, decoded) && decoded == token;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        span = item;
+    }
+    return true;
+}
+
+//Returns the raw text of the value at pointer, strings keep their quotes, empty if it is missing
+std::string_view JSONViewRaw(const JSONView &view, string pointer) {
+    JSONSpan span;
+    if (!jsonFind(view, pointer, span) || !span.complete) {
+        return std::string_view();
+    }
+    return std::string_view(view.data.data() + span.begin, span.end - span.begin);
+}
+
+//Will decode the string at pointer into value, returns false if it is missing or not a string
+bool JSONViewString(const JSONView &view, string pointer, string &value) {
+    std::string_view raw = JSONViewRaw(view, pointer);
+    if (raw.size() < 2 || raw.front() != '"') {
+        return false;
+    }
+    return unescapeJSON(raw.substr(1, raw.size() - 2), value);
+}
+
+//Returns true if text is a number in the RFC 8259 grammar, which strtod and strtoll are wider than
+//Hex, inf, nan, leading zeros, a leading + and bare dots or exponents are rejected
+static bool isJsonNumber(std::string_view text) {
+    size_t i = 0;
+    auto digits = [&text, &i]() {
+        size_t start = i;
+        while (i < text.size() && isdigit((unsigned char)text[i])) {
+            i++;
+        }
+        return i - start;
+    };
+    if (i < text.size() && text[i] == '-') {
+        i++;
+    }
+    if (i < text.size() && text[i] == '0') {
+        i++;
+    } else if (i >= text.size() || digits() == 0) {
+        return false;
+    }
+    if (i < text.size() && text[i] == '.') {
+        i++;
+        if (digits() == 0) {
+            return false;
+        }
+    }
+    if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+        i++;
+        if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+            i++;
+        }
+        if (digits() == 0) {
+            return false;
+        }
+    }
+    return i == text.size();
+}
+
+//Will read the number at pointer into value, returns false if it is missing or not a number
+bool JSONViewNumber(const JSONView &view, string pointer, double &value) {
+    std::string_view raw = JSONViewRaw(view, pointer);
+    if (!isJsonNumber(raw)) {
+        return false;
+    }
+    string text(raw);
+    char *end;
+    value = strtod(text.c_str(), &end);
+    return end == text.c_str() + text.size();
+}
+
+//Will read the integer at pointer into value, returns false if it is missing, fractional or out of range
+bool JSONViewInt(const JSONView &view, string pointer, long long &value) {
+    std::string_view raw = JSONViewRaw(view, pointer);
+    if (!isJsonNumber(raw)) {
+        return false;
+    }
+    string text(raw);
+    char *end;
+    errno = 0;
+    value = strtoll(text.c_str(), &end, 10);
+    return errno == 0 && end == text.c_str() + text.size();
+}
+
+//Will read the true or false at pointer into value, returns false if it is missing or not a boolean
+bool JSONViewBool(const JSONView &view, string pointer, bool &value) {
+    std::string_view raw = JSONViewRaw(view, pointer);
+    if (raw != "true" && raw != "false") {
+        return false;
+    }
+    value = raw == "true";
+    return true;
+}
+
+//Returns how many elements or members the array or object at pointer has, 0 for other values
+size_t JSONViewSize(const JSONView &view, string pointer) {
+    JSONSpan span;
+    if (!jsonFind(view, pointer, span) || !span.complete || (view.data[span.begin] != '{' && view.data[span.begin] != '[')) {
+        return 0;
+    }
+    size_t pos = span.begin + 1;
+    size_t entry = span.first + 1;
+    size_t n = 0;
+    std::string_view key;
+    JSONSpan item;
+    while (jsonNextItem(view, span, pos, entry, key, item)) {
+        n++;
+    }
+    return n;
+}
+
+//Returns the member names of the object at pointer in document order, empty for other values
+std::vector<string> JSONViewKeys(const JSONView &view, string pointer) {
+    std::vector<string> keys;
+    JSONSpan span;
+    if (!jsonFind(view, pointer, span) || !span.complete || view.data[span.begin] != '{') {
+        return keys;
+    }
+    size_t pos = span.begin + 1;
+    size_t entry = span.first + 1;
+    std::string_view key;
+    JSONSpan item;
+    string decoded;
+    while (jsonNextItem(view, span, pos, entry, key, item)) {
+        keys.push_back(unescapeJSON(key, decoded) ? decoded : string(key));
+    }
+    return keys;
+}
+
+//Returns true once the whole document has arrived, only whitespace may follow its root value
+bool JSONViewComplete(const JSONView &view) {
+    JSONSpan span;
+    if (!jsonSpanAt(view, 0, 0, span) || !span.complete) {
+        return false;
+    }
+    //A scalar root may still be growing, "12" could become "123"
+    if (view.data[span.begin] != '{' && view.data[span.begin] != '[' && view.data[span.begin] != '"') {
+        return false;
+    }
+    for (size_t i = span.end; i < view.data.size(); i++) {
+        if (!is_json_space(view.data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Struct defining a running loopback test server, the server stops when the last reference is released
+struct HTTPTestServer {
+    HTTPConnection listener;
+    int port = 0;
+    std::mutex lock;
+    HTTPTestServerConfig config;
+#ifndef REQUESTS_NO_TLS
+    SSL_CTX *tls = NULL;
+#endif
+    std::atomic<bool> stopping;
+    std::thread acceptor;
+    //Connection threads are detached, stopTestServer waits until active drops to 0
+    std::condition_variable idle;
+    int active = 0;
+    std::atomic<long long> connections;
+    std::atomic<long long> requests;
+    std::atomic<long long> tunnels;
+    std::atomic<long long> forwarded;
+
+    HTTPTestServer() : stopping(false), connections(0), requests(0), tunnels(0), forwarded(0) {}
+
+    ~HTTPTestServer() {
+        stopTestServer(*this);
+#ifndef REQUESTS_NO_TLS
+        if (tls != NULL) {
+            SSL_CTX_free(tls);
+        }
+#endif
+    }
+};
+
+//Sleeps for ms while the server is running, returns false once it is stopping
+static bool testServerSleep(HTTPTestServer &server, int ms) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (!server.stopping.load()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= until) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(until - now, std::chrono::milliseconds(20)));
+    }
+    return false;
+}
+
+//Waits until conn has bytes to read, returns false once the server is stopping
+static bool testServerWait(HTTPTestServer &server, HTTPConnection &conn) {
+    while (!server.stopping.load()) {
+        if (waitReadable(conn, 20)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Writes data to conn in pieces, honouring the drip and bandwidth settings of config
+//written counts the bytes already sent in this response so the bandwidth cap spans the headers and body
+static bool testServerWrite(HTTPTestServer &server, HTTPConnection &conn, const HTTPTestServerConfig &config, const string &data, size_t &written, std::chrono::steady_clock::time_point start) {
+    size_t piece = data.size();
+    if (config.dripBytes > 0) {
+        piece = config.dripBytes;
+    } else if (config.bandwidth > 0) {
+        //Pieces of about 10 ms keep the rate smooth
+        piece = std::max<size_t>(config.bandwidth / 100, 1);
+    }
+    for (size_t offset = 0; offset < data.size(); offset += piece) {
+        size_t len = std::min(piece, data.size() - offset);
+        if (!connectionWrite(conn, data.data() + offset, len)) {
+            return false;
+        }
+        written += len;
+        if (config.dripDelayMs > 0 && offset + len < data.size() && !testServerSleep(server, config.dripDelayMs)) {
+            return false;
+        }
+        if (config.bandwidth > 0) {
+            auto due = start + std::chrono::microseconds((long long)(written * 1e6 / config.bandwidth));
+            int wait = (int)std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now()).count();
+            if (wait > 0 && !testServerSleep(server, wait)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//Reads one request from conn into head and body, buffer keeps bytes of the next pipelined request
+static bool testServerReadRequest(HTTPTestServer &server, HTTPConnection &conn, string &buffer, string &head, string &body) {
+    char chunk[16384];
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == string::npos) {
+        if (buffer.size() > 65536 || !testServerWait(server, conn)) {
+            return false;
+        }
+        int read = connectionRead(conn, chunk, sizeof(chunk));
+        if (read <= 0) {
+            return false;
+        }
+        buffer.append(chunk, read);
+    }
+    head = buffer.substr(0, end + 2);
+    buffer.erase(0, end + 4);
+    long long contentLength = 0;
+    bool chunked = false;
+    bool expect = false;
+    for (size_t line = head.find("\r\n") + 2; line < head.size(); line = head.find("\r\n", line) + 2) {
+        size_t colon = head.find(':', line);
+        size_t lineEnd = head.find("\r\n", line);
+        if (colon == string::npos || colon > lineEnd) {
+            continue;
+        }
+        string key = head.substr(line, colon - line);
+        string value = head.substr(colon + 1, lineEnd - colon - 1);
+        value.erase(0, value.find_first_not_of(' '));
+        if (equalsIgnoreCase(key, "Content-Length")) {
+            contentLength = atoll(value.c_str());
+        } else if (equalsIgnoreCase(key, "Transfer-Encoding")) {
+            chunked = value.find("chunked") != string::npos;
+        } else if (equalsIgnoreCase(key, "Expect")) {
+            expect = true;
+        }
+    }
+    if (expect && buffer.empty()) {
+        const char *proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!connectionWrite(conn, proceed, strlen(proceed))) {
+            return false;
+        }
+    }
+    body.clear();
+    if (!chunked) {
+        while ((long long)buffer.size() < contentLength) {
+            if (!testServerWait(server, conn)) {
+                return false;
+            }
+            int read = connectionRead(conn, chunk, sizeof(chunk));
+            if (read <= 0) {
+                return false;
+            }
+            buffer.append(chunk, read);
+        }
+        body = buffer.substr(0, contentLength);
+        buffer.erase(0, contentLength);
+        return true;
+    }
+    while (true) {
+        size_t lineEnd = buffer.find("\r\n");
+        if (lineEnd != string::npos) {
+            long long size = strtoll(buffer.c_str(), NULL, 16);
+            if (buffer.size() >= lineEnd + 2 + size + 2) {
+                body.append(buffer, lineEnd + 2, size);
+                buffer.erase(0, lineEnd + 2 + size + 2);
+                if (size == 0) {
+                    return true;
+                }
+                continue;
+            }
+        }
+        if (!testServerWait(server, conn)) {
+            return false;
+        }
+        int read = connectionRead(conn, chunk, sizeof(chunk));
+        if (read <= 0) {
+            return false;
+        }
+        buffer.append(chunk, read);
+    }
+}
+
+//Opens the connection of a proxying test server to authority, a host:port whose port defaults to 80
+static bool testServerUpstream(HTTPConnection &upstream, const string &authority) {
+    size_t colon = authority.rfind(':');
+    if (colon == string::npos) {
+        return openSocket(upstream, authority, 80);
+    }
+    return openSocket(upstream, authority.substr(0, colon), atoi(authority.c_str() + colon + 1));
+}
+
+//Copies bytes between client and upstream in both directions until either side closes or the server stops
+static void testServerTunnel(HTTPTestServer &server, HTTPConnection &client, HTTPConnection &upstream) {
+    char chunk[16384];
+    while (!server.stopping.load()) {
+        HTTPConnection *from = waitReadable(client, 5) ? &client : waitReadable(upstream, 5) ? &upstream : NULL;
+        if (from == NULL) {
+            continue;
+        }
+        HTTPConnection *to = from == &client ? &upstream : &client;
+        int read = connectionRead(*from, chunk, sizeof(chunk));
+        if (read <= 0 || !connectionWrite(*to, chunk, read)) {
+            return;
+        }
+    }
+}
+
+//Sends an absolute-form request to its origin over upstream and answers conn with the response
+//upstream stays open for the next request to the same origin, hop-by-hop headers are not passed on
+static bool testServerForward(HTTPConnection &conn, HTTPConnection &upstream, string &upstreamAuthority, const string &head, const string &body, bool keepAlive) {
+    size_t methodEnd = head.find(' ');
+    size_t targetEnd = head.find(' ', methodEnd + 1);
+    string method = head.substr(0, methodEnd);
+    string target = head.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    URLView view;
+    if (!parseURL(target, view) || view.scheme != "http") {
+        return false;
+    }
+    string authority = string(view.host) + ":" + (view.port.empty() ? "80" : string(view.port));
+    if (upstream.sock == INVALID_SOCKET || authority != upstreamAuthority) {
+        closeConnection(upstream);
+        upstream = HTTPConnection();
+        if (!testServerUpstream(upstream, authority)) {
+            return false;
+        }
+        upstreamAuthority = authority;
+    }
+    string request = method + " " + (view.path.empty() ? "/" : string(view.path));
+    if (!view.query.empty()) {
+        request += "?" + string(view.query);
+    }
+    request += " HTTP/1.1\r\n";
+    for (size_t line = head.find("\r\n") + 2; line < head.size(); line = head.find("\r\n", line) + 2) {
+        size_t lineEnd = head.find("\r\n", line);
+        string key = head.substr(line, head.find(':', line) - line);
+        if (equalsIgnoreCase(key, "Proxy-Authorization") || equalsIgnoreCase(key, "Proxy-Connection") || equalsIgnoreCase(key, "Connection")
+            || equalsIgnoreCase(key, "Transfer-Encoding") || equalsIgnoreCase(key, "Content-Length") || equalsIgnoreCase(key, "Expect")) {
+            continue;
+        }
+        request.append(head, line, lineEnd + 2 - line);
+    }
+    //The body was already read whole, so it goes on with a Content-Length whatever its framing was
+    if (!body.empty()) {
+        request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    }
+    request += "\r\n" + body;
+    int status_code = 0;
+    string headers;
+    string responseBody;
+    HTTPStreamHandlers handlers;
+    handlers.on_status = [&status_code](int code) {
+        status_code = code;
+        return true;
+    };
+    handlers.on_header = [&headers](const string &key, const string &value) {
+        if (!equalsIgnoreCase(key, "Transfer-Encoding") && !equalsIgnoreCase(key, "Content-Length") && !equalsIgnoreCase(key, "Connection")) {
+            headers += key + ": " + value + "\r\n";
+        }
+        return true;
+    };
+    handlers.on_body_chunk = [&responseBody](std::string_view chunk) {
+        responseBody.append(chunk);
+        return true;
+    };
+    bool received = connectionWrite(upstream, request.data(), request.size()) && receiveResponse(upstream, handlers, method == "HEAD", NULL);
+    if (!received || !upstream.reusable) {
+        closeConnection(upstream);
+        upstream = HTTPConnection();
+    }
+    if (!received) {
+        return false;
+    }
+    string response = "HTTP/1.1 " + std::to_string(status_code) + " Forwarded\r\n" + headers;
+    response += "Content-Length: " + std::to_string(responseBody.size()) + "\r\n";
+    response += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    response += responseBody;
+    return connectionWrite(conn, response.data(), response.size());
+}
+
+//Serves requests on one accepted connection until it closes, the server stops or keep-alive ends it
+static void testServerConnection(HTTPTestServer &server, HTTPConnection conn) {
+#ifndef REQUESTS_NO_TLS
+    if (server.tls != NULL) {
+        conn.ssl = SSL_new(server.tls);
+        SSL_set_fd(conn.ssl, (int)conn.sock);
+        SigpipeGuard sigpipe;
+        if (!testServerWait(server, conn) || SSL_accept(conn.ssl) != 1) {
+            closeConnection(conn);
+            return;
+        }
+    }
+#endif
+    string buffer;
+    string head;
+    string body;
+    int served = 0;
+    //Origin connection of a proxying server, reused while requests go to the same host:port
+    HTTPConnection upstream;
+    string upstreamAuthority;
+    while (testServerReadRequest(server, conn, buffer, head, body)) {
+        server.requests++;
+        served++;
+        HTTPTestServerConfig config;
+        {
+            std::lock_guard<std::mutex> guard(server.lock);
+            config = server.config;
+        }
+        bool keepAlive = config.keepAlive && head.find("Connection: close") == string::npos
+            && (config.maxRequestsPerConnection <= 0 || served < config.maxRequestsPerConnection);
+        if (config.proxy && head.compare(0, 8, "CONNECT ") == 0) {
+            //The rest of the connection is relayed as is, the client runs its ssl handshake through it
+            string authority = head.substr(8, head.find(' ', 8) - 8);
+            HTTPConnection tunnel;
+            if (!testServerUpstream(tunnel, authority)) {
+                const char *failed = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                connectionWrite(conn, failed, strlen(failed));
+                break;
+            }
+            server.tunnels++;
+            const char *established = "HTTP/1.1 200 Connection established\r\n\r\n";
+            if (connectionWrite(conn, established, strlen(established)) && connectionWrite(tunnel, buffer.data(), buffer.size())) {
+                testServerTunnel(server, conn, tunnel);
+            }
+            closeConnection(tunnel);
+            break;
+        }
+        if (config.proxy) {
+            server.forwarded++;
+            if (!testServerForward(conn, upstream, upstreamAuthority, head, body, keepAlive)) {
+                const char *failed = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                connectionWrite(conn, failed, strlen(failed));
+                break;
+            }
+            if (!keepAlive) {
+                break;
+            }
+            continue;
+        }
+        //A numeric path sets the body size, /echo answers with the request body and /request with the whole request
+        size_t pathStart = head.find(' ') + 1;
+        string path = head.substr(pathStart, head.find(' ', pathStart) - pathStart);
+        path = path.substr(0, path.find('?'));
+        string response;
+        if (path == "/echo") {
+            response = body;
+        } else if (path == "/request") {
+            response = head + "\r\n" + body;
+        } else {
+            size_t size = config.responseSize;
+            if (path.size() > 1 && isdigit((unsigned char)path[1])) {
+                size = (size_t)atoll(path.c_str() + 1);
+            }
+            response.resize(size);
+            for (size_t i = 0; i < size; i++) {
+                response[i] = 'a' + i % 26;
+            }
+        }
+        bool truncated = config.closeAfter >= 0 && (size_t)config.closeAfter < response.size();
+
+        string headers = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n";
+        headers += config.chunked ? "Transfer-Encoding: chunked\r\n" : "Content-Length: " + std::to_string(response.size()) + "\r\n";
+        headers += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        if (truncated) {
+            response.resize(config.closeAfter);
+        }
+        string wire;
+        if (config.chunked) {
+            size_t chunkSize = config.dripBytes > 0 ? config.dripBytes : 8192;
+            for (size_t offset = 0; offset < response.size(); offset += chunkSize) {
+                size_t len = std::min(chunkSize, response.size() - offset);
+                char size[20];
+                snprintf(size, sizeof(size), "%zx\r\n", len);
+                wire += size;
+                wire.append(response, offset, len);
+                wire += "\r\n";
+            }
+            if (!truncated) {
+                wire += "0\r\n\r\n";
+            }
+        } else {
+            wire.swap(response);
+        }
+
+        if (config.latencyMs > 0 && !testServerSleep(server, config.latencyMs)) {
+            break;
+        }
+        auto start = std::chrono::steady_clock::now();
+        size_t written = 0;
+        if (!testServerWrite(server, conn, config, headers, written, start) || !testServerWrite(server, conn, config, wire, written, start)) {
+            break;
+        }
+        if (truncated || !keepAlive) {
+            break;
+        }
+    }
+    closeConnection(upstream);
+    closeConnection(conn);
+}
+
+#ifndef REQUESTS_NO_TLS
+//Creates a server context with a throwaway P-256 key and a self-signed certificate for localhost
+static SSL_CTX *createTestServerTLS() {
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (keygen == NULL || EVP_PKEY_keygen_init(keygen) <= 0
+        || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen, NID_X9_62_prime256v1) <= 0 || EVP_PKEY_keygen(keygen, &key) <= 0) {
+        EVP_PKEY_CTX_free(keygen);
+        return NULL;
+    }
+    EVP_PKEY_CTX_free(keygen);
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 7 * 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    SSL_CTX *ctx = NULL;
+    if (X509_sign(cert, key, EVP_sha256()) > 0) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        if (ctx != NULL && (SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1)) {
+            SSL_CTX_free(ctx);
+            ctx = NULL;
+        }
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+}
+#endif
+
+//Accepts connections and hands each one to a detached connection thread
+static void testServerAccept(HTTPTestServer *server) {
+    while (testServerWait(*server, server->listener)) {
+        HTTPConnection conn;
+        conn.sock = accept(server->listener.sock, NULL, NULL);
+        if (conn.sock == INVALID_SOCKET) {
+            continue;
+        }
+        disableSigpipe(conn.sock);
+        int nodelay = 1;
+        setsockopt(conn.sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+        server->connections++;
+        {
+            std::lock_guard<std::mutex> guard(server->lock);
+            server->active++;
+        }
+        std::thread([server, conn]() {
+            testServerConnection(*server, conn);
+            std::lock_guard<std::mutex> guard(server->lock);
+            server->active--;
+            server->idle.notify_all();
+        }).detach();
+    }
+}
+
+//Will start an HTTP or HTTPS server on 127.0.0.1 for tests and benchmarks, returns nullptr if it can not listen
+std::shared_ptr<HTTPTestServer> startTestServer(HTTPTestServerConfig config) {
+    std::shared_ptr<HTTPTestServer> server = std::make_shared<HTTPTestServer>();
+    server->config = config;
+#if !(defined(__unix__) || defined(__linux__) || defined(__APPLE__))
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        return nullptr;
+    }
+#endif
+    if (config.tls) {
+#ifndef REQUESTS_NO_TLS
+        server->tls = createTestServerTLS();
+        if (server->tls == NULL) {
+            return nullptr;
+        }
+#else
+        return nullptr;
+#endif
+    }
+    if (!config.socketPath.empty()) {
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (config.socketPath.size() >= sizeof(sa.sun_path)) {
+            return nullptr;
+        }
+        memcpy(sa.sun_path, config.socketPath.data(), config.socketPath.size());
+        //A socket file left behind by an earlier run would make bind fail
+        unlink(config.socketPath.c_str());
+        server->listener.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server->listener.sock == INVALID_SOCKET || bind(server->listener.sock, (struct sockaddr *)&sa, sizeof(sa)) < 0
+            || listen(server->listener.sock, 128) < 0) {
+            return nullptr;
+        }
+        server->acceptor = std::thread(testServerAccept, server.get());
+        return server;
+#else
+        return nullptr;
+#endif
+    }
+    server->listener.sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listener.sock == INVALID_SOCKET) {
+        return nullptr;
+    }
+    int reuse = 1;
+    setsockopt(server->listener.sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(config.port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t salen = sizeof(sa);
+    if (bind(server->listener.sock, (struct sockaddr *)&sa, salen) < 0 || listen(server->listener.sock, 128) < 0
+        || getsockname(server->listener.sock, (struct sockaddr *)&sa, &salen) < 0) {
+        return nullptr;
+    }
+    server->port = ntohs(sa.sin_port);
+    server->acceptor = std::thread(testServerAccept, server.get());
+    return server;
+}
+
+//Returns the port the test server listens on
+int testServerPort(HTTPTestServer &server) {
+    return server.port;
+}
+
+//Returns the URL of path on the test server
+string testServerURL(HTTPTestServer &server, string path) {
+#ifndef REQUESTS_NO_TLS
+    string scheme = server.tls != NULL ? "https" : "http";
+#else
+    string scheme = "http";
+#endif
+    if (!server.config.socketPath.empty()) {
+        string encoded;
+        for (char c : server.config.socketPath) {
+            if (c == '/') {
+                encoded += "%2F";
+            } else if (c == '%') {
+                encoded += "%25";
+            } else {
+                encoded += c;
+            }
+        }
+        return scheme + "+unix://" + encoded + path;
+    }
+    return scheme + "://127.0.0.1:" + std::to_string(server.port) + path;
+}
+
+//Will change how the test server answers, requests already being answered keep the old config
+void setTestServerConfig(HTTPTestServer &server, HTTPTestServerConfig config) {
+    std::lock_guard<std::mutex> guard(server.lock);
+    //The listening socket stays as it is
+    config.tls = server.config.tls;
+    config.port = server.config.port;
+    config.socketPath = server.config.socketPath;
+    server.config = config;
+}
+
+//Returns how many connections and requests the test server has handled
+HTTPTestServerStats getTestServerStats(HTTPTestServer &server) {
+    HTTPTestServerStats stats;
+    stats.connections = server.connections.load();
+    stats.requests = server.requests.load();
+    stats.tunnels = server.tunnels.load();
+    stats.forwarded = server.forwarded.load();
+    return stats;
+}
+
+//Will stop the test server, close its connections and wait for its threads
+void stopTestServer(HTTPTestServer &server) {
+    server.stopping = true;
+    if (server.acceptor.joinable()) {
+        server.acceptor.join();
+    }
+    std::unique_lock<std::mutex> guard(server.lock);
+    server.idle.wait(guard, [&server]() { return server.active == 0; });
+    guard.unlock();
+    if (server.listener.sock != INVALID_SOCKET && !server.config.socketPath.empty()) {
+        unlink(server.config.socketPath.c_str());
+    }
+    closeConnection(server.listener);
+}
+
+//Runs the library against loopback test servers and prints Success or Failure for each case, needs no network
+void test_loopback() {
+    int failures = 0;
+    auto check = [&failures](const char *name, bool ok) {
+        std::cout << name << ": " << (ok ? "Success" : "Failure") << std::endl;
+        failures += ok ? 0 : 1;
+    };
+    HTTPTestServerConfig config;
+    std::shared_ptr<HTTPTestServer> server = startTestServer(config);
+    if (server == nullptr) {
+        check("start", false);
+        return;
+    }
+    HTTPResponse response = HTTPGet(CreateGetRequest(testServerURL(*server, "/100000")));
+    check("content-length body", response.status_code == 200 && response.body.size() == 100000 && response.body[26] == 'a');
+    response = HTTPPost(CreateJsonPostRequest(testServerURL(*server, "/echo"), "{\"loopback\":true}"));
+    check("post echo", response.body == "{\"loopback\":true}");
+
+    config.chunked = true;
+    config.dripBytes = 1000;
+    config.dripDelayMs = 1;
+    setTestServerConfig(*server, config);
+    response = HTTPGet(CreateGetRequest(testServerURL(*server, "/20000")));
+    check("chunked slow drip", response.status_code == 200 && response.body.size() == 20000);
+
+    config = HTTPTestServerConfig();
+    config.bandwidth = 1 << 20;
+    setTestServerConfig(*server, config);
+    auto start = std::chrono::steady_clock::now();
+    response = HTTPGet(CreateGetRequest(testServerURL(*server, "/262144")));
+    double ms = elapsedMs(start);
+    check("bandwidth cap", response.body.size() == 262144 && ms > 200);
+
+    config = HTTPTestServerConfig();
+    config.latencyMs = 100;
+    setTestServerConfig(*server, config);
+    start = std::chrono::steady_clock::now();
+    response = HTTPGet(CreateGetRequest(testServerURL(*server, "/10")));
+    check("latency", response.status_code == 200 && elapsedMs(start) >= 100);
+
+    config = HTTPTestServerConfig();
+    config.closeAfter = 500;
+    setTestServerConfig(*server, config);
+    response = HTTPGet(CreateGetRequest(testServerURL(*server, "/1000")));
+    check("early close", response.body.size() < 1000);
+
+    std::shared_ptr<HTTPTestServer> tls = startTestServer([]() {
+        HTTPTestServerConfig tlsConfig;
+        tlsConfig.tls = true;
+        return tlsConfig;
+    }());
+    if (tls != nullptr) {
+        HTTPGetRequest request = CreateGetRequest(testServerURL(*tls, "/5000"));
+        request.sslVerify = false;
+        response = HTTPGet(request);
+        check("https", response.status_code == 200 && response.body.size() == 5000);
+    }
+
+    //A proxying test server forwards plain http in absolute-form and tunnels https with CONNECT
+    setTestServerConfig(*server, HTTPTestServerConfig());
+    std::shared_ptr<HTTPTestServer> proxy = startTestServer([]() {
+        HTTPTestServerConfig proxyConfig;
+        proxyConfig.proxy = true;
+        return proxyConfig;
+    }());
+    if (proxy != nullptr) {
+        HTTPGetRequest request = CreateGetRequest(testServerURL(*server, "/3000?q=1"));
+        request.proxy = testServerURL(*proxy);
+        response = HTTPGet(request);
+        HTTPPostRequest post = CreateJsonPostRequest(testServerURL(*server, "/echo"), "{\"proxied\":true}");
+        post.proxy = testServerURL(*proxy);
+        HTTPResponse echoed = HTTPPost(post);
+        HTTPTestServerStats stats = getTestServerStats(*proxy);
+        check("proxy absolute-form", response.status_code == 200 && response.body.size() == 3000 && echoed.body == "{\"proxied\":true}"
+            && stats.forwarded == 2 && stats.connections == 1);
+        if (tls != nullptr) {
+            request = CreateGetRequest(testServerURL(*tls, "/4000"));
+            request.sslVerify = false;
+            request.proxy = testServerURL(*proxy);
+            response = HTTPGet(request);
+            check("proxy connect tunnel", response.status_code == 200 && response.body.size() == 4000 && getTestServerStats(*proxy).tunnels == 1);
+        }
+    }
+
+    //A response over the limits of its request is reported as status 0 without a body
+    HTTPGetRequest limited = CreateGetRequest(testServerURL(*server, "/5000"));
+    limited.maxBodySize = 1000;
+    response = HTTPGet(limited);
+    check("max body size", response.status_code == 0 && response.body.empty());
+    limited = CreateGetRequest(testServerURL(*server, "/10"));
+    limited.maxHeaderBytes = 32;
+    response = HTTPGet(limited);
+    check("max header bytes", response.status_code == 0);
+
+    //Concurrent bodies that together exceed the memory budget wait for each other instead of failing
+    HTTPMemoryLimitsConfig limits;
+    limits.memoryBudget = 256 * 1024;
+    setMemoryLimits(limits);
+    std::atomic<int> complete(0);
+    std::vector<std::thread> downloads;
+    for (int i = 0; i < 4; i++) {
+        downloads.emplace_back([&server, &complete]() {
+            HTTPResponse body = HTTPGet(CreateGetRequest(testServerURL(*server, "/200000")));
+            if (body.status_code == 200 && body.body.size() == 200000) {
+                complete++;
+            }
+        });
+    }
+    for (std::thread &download : downloads) {
+        download.join();
+    }
+    //A single body larger than the whole budget fails instead of being buffered
+    HTTPResponse oversized = HTTPGet(CreateGetRequest(testServerURL(*server, "/300000")));
+    check("memory budget", complete.load() == 4 && oversized.status_code == 0 && getMemoryInFlight() == 0);
+    setMemoryLimits(HTTPMemoryLimitsConfig());
+
+#if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
+    std::shared_ptr<HTTPTestServer> local = startTestServer([]() {
+        HTTPTestServerConfig localConfig;
+        localConfig.socketPath = "/tmp/requests_loopback_" + std::to_string(getpid()) + ".sock";
+        return localConfig;
+    }());
+    if (local != nullptr) {
+        response = HTTPGet(CreateGetRequest(testServerURL(*local, "/1234")));
+        HTTPResponse echoed = HTTPPost(CreateJsonPostRequest(testServerURL(*local, "/echo"), "{\"unix\":true}"));
+        check("http+unix", response.status_code == 200 && response.body.size() == 1234 && echoed.body == "{\"unix\":true}"
+            && getTestServerStats(*local).connections == 1);
+    }
+#endif
+
+    //Concurrent requests after preconnect take the parked connections instead of opening their own
+    std::shared_ptr<HTTPTestServer> warm = startTestServer();
+    if (warm != nullptr) {
+        int opened = preconnect(testServerURL(*warm), 4);
+        complete = 0;
+        std::vector<std::thread> requests;
+        for (int i = 0; i < 4; i++) {
+            requests.emplace_back([&warm, &complete]() {
+                if (HTTPGet(CreateGetRequest(testServerURL(*warm, "/100"))).status_code == 200) {
+                    complete++;
+                }
+            });
+        }
+        for (std::thread &request : requests) {
+            request.join();
+        }
+        HTTPTestServerStats stats = getTestServerStats(*warm);
+        check("preconnect reuse", opened == 4 && complete.load() == 4 && stats.connections == 4 && stats.requests == 4);
+    }
+
+    //Every address localhost resolves to gets a balancing entry, an address without a listener is skipped after it fails
+    HTTPBalancerConfig balancing;
+    balancing.enabled = true;
+    setLoadBalancing(balancing);
+    string balancedURL = "http://localhost:" + std::to_string(testServerPort(*server)) + "/10";
+    int succeeded = 0;
+    for (int i = 0; i < 6; i++) {
+        succeeded += HTTPGet(CreateGetRequest(balancedURL)).status_code == 200 ? 1 : 0;
+    }
+    setLoadBalancing(HTTPBalancerConfig());
+    std::vector<HTTPBackendStats> backends = getBalancerStats("localhost", testServerPort(*server));
+    unsigned long long served = 0;
+    bool idle = true;
+    for (const HTTPBackendStats &backend : backends) {
+        served += backend.requests - backend.failures;
+        idle = idle && backend.outstanding == 0;
+    }
+    check("balancer stats", succeeded == 6 && !backends.empty() && served == 6 && idle);
+
+    //One batch lookup fills the ipaddr of every request with a name, addresses are kept as they are
+    std::vector<HTTPGetRequest> batch;
+    batch.push_back(CreateGetRequest(balancedURL));
+    batch.push_back(CreateGetRequest(balancedURL));
+    batch.push_back(CreateGetRequest(testServerURL(*server, "/10")));
+    resolveRequestHosts(batch);
+    bool resolved = true;
+    for (const HTTPGetRequest &request : batch) {
+        resolved = resolved && request.ipaddr == "127.0.0.1" && HTTPGet(request).status_code == 200;
+    }
+    std::map<string, string> names = resolvdnsnames({ "localhost", "127.0.0.1", "" });
+    check("resolve request hosts", resolved && batch[0].host == "localhost" && names["localhost"] == "127.0.0.1"
+        && names["127.0.0.1"] == "127.0.0.1" && names[""].empty());
+
+    //A document read while it arrives in pieces, then looked up by path
+    string document = "{\"name\":\"loop\\\"back\",\"items\":[";
+    for (int i = 0; i < 1000; i++) {
+        document += (i > 0 ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"v\":2.5}";
+    }
+    document += "],\"ok\":true}";
+    config = HTTPTestServerConfig();
+    config.dripBytes = 4096;
+    setTestServerConfig(*server, config);
+    std::shared_ptr<JSONView> view = JSONViewCreate();
+    int pieces = 0;
+    bool partial = true;
+    HTTPStreamHandlers handlers;
+    handlers.on_body_chunk = [&view, &pieces, &partial](std::string_view chunk) {
+        partial = partial && !JSONViewComplete(*view);
+        pieces++;
+        return JSONViewAppend(*view, chunk);
+    };
+    bool streamed = HTTPPostStream(CreateJsonPostRequest(testServerURL(*server, "/echo"), document), handlers);
+    setTestServerConfig(*server, HTTPTestServerConfig());
+    string name;
+    long long id = 0;
+    double value = 0;
+    bool ok = false;
+    check("json view streaming", streamed && pieces > 1 && partial && JSONViewComplete(*view) && JSONViewSize(*view, "/items") == 1000
+        && JSONViewString(*view, "/name", name) && name == "loop\"back" && JSONViewInt(*view, "/items/999/id", id) && id == 999
+        && JSONViewNumber(*view, "/items/5/v", value) && value == 2.5 && JSONViewBool(*view, "/ok", ok) && ok
+        && JSONViewKeys(*view, "") == std::vector<string>({ "name", "items", "ok" }) && JSONViewRaw(*view, "/missing").empty());
+
+    //A prepared request puts the same bytes on the wire as encode_payload of the request it stands for
+    std::shared_ptr<const HTTPPreparedRequest> prepared = CreatePreparedRequest(CreateJsonPostRequest(testServerURL(*server, "/request"), ""));
+    HTTPHeaderList extra = { { "X-Id", "7" } };
+    response = HTTPSendPrepared(*prepared, "?id=7", "{\"id\":7}", extra);
+    HTTPPostRequest equivalent = CreateJsonPostRequest(testServerURL(*server, "/request?id=7"), "{\"id\":7}");
+    addHeader(equivalent, "X-Id", "7");
+    check("prepared request bytes", response.status_code == 200 && response.body == encode_payload(equivalent)
+        && response.body == encode_payload(*prepared, "?id=7", "{\"id\":7}", extra));
+
+    //A produced body goes out chunked and the server joins the chunks back together
+    std::vector<string> parts = { "[1,2,", "3,4,", "5]" };
+    size_t produced = 0;
+    response = HTTPPostChunked(CreateJsonPostRequest(testServerURL(*server, "/request"), ""), [&parts, &produced](char *buffer, size_t size) {
+        if (produced == parts.size()) {
+            return 0LL;
+        }
+        size_t len = std::min(size, parts[produced].size());
+        memcpy(buffer, parts[produced++].data(), len);
+        return (long long)len;
+    });
+    check("chunked post", response.status_code == 200 && response.body.find("Transfer-Encoding: chunked\r\n") != string::npos
+        && response.body.size() > 11 && response.body.compare(response.body.size() - 11, 11, "[1,2,3,4,5]") == 0);
+
+    //A body over the Expect threshold is sent once the server answers 100 Continue, long before the timeout
+    HTTPExpectContinueConfig expect;
+    expect.threshold = 1;
+    expect.timeoutMs = 5000;
+    setExpectContinue(expect);
+    start = std::chrono::steady_clock::now();
+    response = HTTPPost(CreateJsonPostRequest(testServerURL(*server, "/request"), "{\"expect\":true}"));
+    check("expect 100-continue", response.status_code == 200 && response.body.find("Expect: 100-continue\r\n") != string::npos
+        && response.body.size() > 15 && response.body.compare(response.body.size() - 15, 15, "{\"expect\":true}") == 0
+        && elapsedMs(start) < 2500);
+    setExpectContinue(HTTPExpectContinueConfig());
+
+    //Identical GETs in flight at the same time share one request to the server
+    std::shared_ptr<HTTPTestServer> slow = startTestServer([]() {
+        HTTPTestServerConfig slowConfig;
+        slowConfig.latencyMs = 300;
+        return slowConfig;
+    }());
+    if (slow != nullptr) {
+        HTTPCoalescingConfig coalescing;
+        coalescing.enabled = true;
+        setRequestCoalescing(coalescing);
+        complete = 0;
+        std::vector<std::thread> waiters;
+        for (int i = 0; i < 8; i++) {
+            waiters.emplace_back([&slow, &complete]() {
+                HTTPResponse shared = HTTPGet(CreateGetRequest(testServerURL(*slow, "/500")));
+                if (shared.status_code == 200 && shared.body.size() == 500) {
+                    complete++;
+                }
+            });
+        }
+        for (std::thread &waiter : waiters) {
+            waiter.join();
+        }
+        setRequestCoalescing(HTTPCoalescingConfig());
+        check("request coalescing", complete.load() == 8 && getTestServerStats(*slow).requests == 1);
+    }
+    std::cout << (failures == 0 ? "Success" : "Failure") << std::endl;
+}
+
+void test_get_google() {
+    HTTPGetRequest request = CreateGetRequest("https://www.google.com");
+    HTTPResponse response = HTTPGet(request);
+    std::cout << response.status_code << std::endl;
+    std::cout << response.body << std::endl;
+    if (response.status_code == 200) {
+        std::cout << "Success" << std::endl;
+    } else {
+        std::cout << "Failure" << std::endl;
+    }
+}
+
+//Prints how many headers per second the response parser handles with each scanning kernel
+void benchmark_header_parsing(int iterations) {
+    string packet = "HTTP/1.1 200 OK\r\n"
+        "Date: Mon, 19 Oct 2026 10:00:00 GMT\r\n"
+        "Content-Type: application/json; charset=utf-8\r\n"
+        "Content-Length: 2\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: private, max-age=0, no-cache, no-store, must-revalidate\r\n"
+        "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n"
+        "Pragma: no-cache\r\n"
+        "Server: nginx/1.25.3\r\n"
+        "Vary: Accept-Encoding, Origin\r\n"
+        "Strict-Transport-Security: max-age=31536000; includeSubDomains; preload\r\n"
+        "X-Content-Type-Options: nosniff\r\n"
+        "X-Frame-Options: SAMEORIGIN\r\n"
+        "X-XSS-Protection: 0\r\n"
+        "Referrer-Policy: strict-origin-when-cross-origin\r\n"
+        "Content-Security-Policy: default-src 'self'; img-src 'self' data: https:; script-src 'self'\r\n"
+        "Access-Control-Allow-Origin: https://www.example.com\r\n"
+        "Access-Control-Allow-Credentials: true\r\n"
+        "Access-Control-Expose-Headers: X-Request-Id, X-RateLimit-Remaining\r\n"
+        "X-Request-Id: 6f1c2a9e-8d3b-4c7a-9e21-0b5f3d8a7c44\r\n"
+        "X-RateLimit-Limit: 5000\r\n"
+        "X-RateLimit-Remaining: 4987\r\n"
+        "X-RateLimit-Reset: 1792402400\r\n"
+        "ETag: W/\"5e2f-1a9c3b7d4e8f6a2b\"\r\n"
+        "Last-Modified: Sun, 18 Oct 2026 21:14:07 GMT\r\n"
+        "Set-Cookie: session=9a8b7c6d5e4f3a2b1c0d; Path=/; Secure; HttpOnly; SameSite=Lax\r\n"
+        "Alt-Svc: h3=\":443\"; ma=86400\r\n"
+        "Via: 1.1 varnish, 1.1 edge-cache-fra-12\r\n"
+        "X-Cache: MISS, HIT\r\n"
+        "X-Served-By: cache-fra-etou8220036-FRA\r\n"
+        "Age: 0\r\n"
+        "\r\n"
+        "{}";
+    int headersPerResponse = 30;
+    std::vector<const HeaderScanKernels *> kernels = { &scalar_kernels };
+#ifdef REQUESTS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernels.push_back(&sse42_kernels);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&avx2_kernels);
+    }
+#endif
+    const HeaderScanKernels *selected = header_scan;
+    HTTPStreamHandlers handlers;
+    size_t seen = 0;
+    handlers.on_header = [&seen](const string &key, const string &value) {
+        seen += key.size() + value.size();
+        return true;
+    };
+    //Each parser is handed the kernel, the global one stays as it is for requests running at the same time
+    for (const HeaderScanKernels *kernel : kernels) {
+        HTTPResponseParser parser;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            initResponseParser(parser, handlers, false);
+            parser.scan = kernel;
+            feedResponseParser(parser, packet.data(), packet.size());
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << kernel->name << (kernel == selected ? " (selected)" : "") << ": "
+                  << (long long)(iterations * (double)headersPerResponse / seconds) << " headers/s" << std::endl;
+    }
+}
+
+//Prints how fast each JSON kernel the cpu supports indexes a 1MB document, and how long one lookup takes
+void benchmark_json_view(int iterations) {
+    string document = "{\"items\":[";
+    for (int i = 0; document.size() < 1024 * 1024; i++) {
+        if (i > 0) {
+            document += ",";
+        }
+        document += "{\"id\":" + std::to_string(i) + ",\"name\":\"item \\\"" + std::to_string(i)
+            + "\\\"\",\"price\":" + std::to_string(i % 997) + ".25,\"tags\":[\"a\",\"b\",\"c\"],\"active\":true}";
+    }
+    document += "],\"count\":1}";
+    std::vector<const JSONScanKernel *> kernels = { &json_scalar_kernel };
+#if defined(REQUESTS_X86_SIMD) && defined(__SSE2__)
+    kernels.push_back(&json_sse2_kernel);
+#endif
+#ifdef REQUESTS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&json_avx2_kernel);
+    }
+#endif
+    const JSONScanKernel *selected = json_scan;
+    //Views are indexed with the kernel directly, the global one stays as it is for views created at the same time
+    for (const JSONScanKernel *kernel : kernels) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            JSONView view;
+            view.data = document;
+            indexJSONData(view, *kernel);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << kernel->name << (kernel == selected ? " (selected)" : "") << ": "
+                  << (int)(iterations * (double)document.size() / seconds / 1e6) << " MB/s indexed" << std::endl;
+    }
+    std::shared_ptr<JSONView> view = JSONViewCreate(document);
+    double price = 0;
+    auto start = std::chrono::steady_clock::now();
+    JSONViewNumber(*view, "/count", price);
+    std::cout << "lookup after 1MB: " << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() << " us" << std::endl;
+}
+
+//Log-linear latency histogram in microseconds, values keep 2 significant decimal digits like an HDR histogram
+const int LATENCY_SUB_BUCKETS = 128;
+const int LATENCY_BUCKETS = LATENCY_SUB_BUCKETS + 40 * (LATENCY_SUB_BUCKETS / 2);
+
+struct LatencyHistogram {
+    std::vector<long long> counts = std::vector<long long>(LATENCY_BUCKETS, 0);
+    long long total = 0;
+    long long max = 0;
+};
+
+//Returns the histogram bucket of value, values below LATENCY_SUB_BUCKETS are exact
+static int latencyBucket(long long value) {
+    if (value < LATENCY_SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+    int shift = -6;
+    for (long long rest = value; rest > 1; rest >>= 1) {
+        shift++;
+    }
+    int bucket = LATENCY_SUB_BUCKETS + (shift - 1) * (LATENCY_SUB_BUCKETS / 2) + (int)(value >> shift) - LATENCY_SUB_BUCKETS / 2;
+    return std::min(bucket, LATENCY_BUCKETS - 1);
+}
+
+//Returns the highest value that lands in bucket
+static long long latencyBucketValue(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = (bucket - LATENCY_SUB_BUCKETS) / (LATENCY_SUB_BUCKETS / 2) + 1;
+    long long sub = (bucket - LATENCY_SUB_BUCKETS) % (LATENCY_SUB_BUCKETS / 2) + LATENCY_SUB_BUCKETS / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void recordLatency(LatencyHistogram &histogram, long long value) {
+    histogram.counts[latencyBucket(value)]++;
+    histogram.total++;
+    histogram.max = std::max(histogram.max, value);
+}
+
+//Returns the latency below which quantile of the recorded values fall
+static long long latencyQuantile(const LatencyHistogram &histogram, double quantile) {
+    if (histogram.total == 0) {
+        return 0;
+    }
+    long long rank = (long long)std::ceil(quantile * histogram.total);
+    long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram.counts[i];
+        if (seen >= std::max(rank, 1LL)) {
+            return std::min(latencyBucketValue(i), histogram.max);
+        }
+    }
+    return histogram.max;
+}
+
+//Drives HTTPGet or HTTPPost at a constant rate and prints throughput, latency percentiles, connections and cpu per request
+//Requests are scheduled open loop, each latency is measured from when the request should have started,
+//so a stalled server shows up in the percentiles instead of silently lowering the offered load
+HTTPLoadReport benchmark_load(HTTPLoadConfig config) {
+    HTTPLoadReport report = HTTPLoadReport();
+    if (config.rate <= 0 || config.seconds <= 0 || config.connections <= 0) {
+        return report;
+    }
+    bool post = config.post || !config.body.empty();
+    HTTPGetRequest get;
+    HTTPPostRequest postRequest;
+    string host;
+    int port;
+    if (post) {
+        postRequest = CreateJsonPostRequest(config.url, config.body);
+        host = postRequest.host;
+        port = postRequest.port;
+    } else {
+        get = CreateGetRequest(config.url);
+        host = get.host;
+        port = get.port;
+    }
+    if (host.empty()) {
+        return report;
+    }
+    string socketPath = post ? postRequest.socketPath : get.socketPath;
+    if (!socketPath.empty()) {
+        host = "unix:" + socketPath;
+        port = 0;
+    }
+    HostMetrics &metrics = getHostMetrics(host, port);
+    unsigned long long opened = metrics.connectionsOpened.load(std::memory_order_relaxed);
+    unsigned long long reused = metrics.connectionsReused.load(std::memory_order_relaxed);
+
+    auto interval = std::chrono::duration<double>(1.0 / config.rate);
+    long long scheduled = (long long)(config.rate * config.seconds);
+    std::atomic<long long> next(0);
+    std::vector<LatencyHistogram> histograms(config.connections);
+    std::vector<long long> errors(config.connections, 0);
+    std::vector<long long> failedStatus(config.connections, 0);
+    std::clock_t cpuStart = std::clock();
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&](int index) {
+        LatencyHistogram &histogram = histograms[index];
+        while (true) {
+            long long i = next.fetch_add(1, std::memory_order_relaxed);
+            if (i >= scheduled) {
+                return;
+            }
+            auto intended = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * (double)i);
+            std::this_thread::sleep_until(intended);
+            int status = post ? HTTPPost(postRequest).status_code : HTTPGet(get).status_code;
+            recordLatency(histogram, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - intended).count());
+            if (status == 0) {
+                errors[index]++;
+            } else if (status >= 400) {
+                failedStatus[index]++;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < config.connections; i++) {
+        workers.emplace_back(worker, i);
+    }
+    for (std::thread &thread : workers) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpuSeconds = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+    LatencyHistogram merged;
+    for (int i = 0; i < config.connections; i++) {
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            merged.counts[bucket] += histograms[i].counts[bucket];
+        }
+        merged.total += histograms[i].total;
+        merged.max = std::max(merged.max, histograms[i].max);
+        report.errors += errors[i];
+        report.failedStatus += failedStatus[i];
+    }
+    report.requests = merged.total;
+    report.seconds = seconds;
+    report.throughput = seconds > 0 ? merged.total / seconds : 0;
+    report.p50Us = latencyQuantile(merged, 0.5);
+    report.p90Us = latencyQuantile(merged, 0.9);
+    report.p99Us = latencyQuantile(merged, 0.99);
+    report.p999Us = latencyQuantile(merged, 0.999);
+    report.maxUs = merged.max;
+    report.connectionsOpened = (long long)(metrics.connectionsOpened.load(std::memory_order_relaxed) - opened);
+    report.connectionsReused = (long long)(metrics.connectionsReused.load(std::memory_order_relaxed) - reused);
+    report.cpuUsPerRequest = merged.total > 0 ? cpuSeconds * 1e6 / merged.total : 0;
+
+    std::cout << (post ? "POST " : "GET ") << config.url << " at " << config.rate << " req/s for " << config.seconds
+              << " s over " << config.connections << " connections" << std::endl;
+    std::cout << "  requests:    " << report.requests << " in " << seconds << " s, " << (long long)report.throughput << " req/s" << std::endl;
+    std::cout << "  errors:      " << report.errors << " failed, " << report.failedStatus << " status >= 400" << std::endl;
+    std::cout << "  latency us:  p50 " << report.p50Us << ", p90 " << report.p90Us << ", p99 " << report.p99Us
+              << ", p99.9 " << report.p999Us << ", max " << report.maxUs << std::endl;
+    std::cout << "  connections: " << report.connectionsOpened << " opened, " << report.connectionsReused << " reused" << std::endl;
+    std::cout << "  cpu:         " << report.cpuUsPerRequest << " us per request" << std::endl;
+    return report;
 }